@@ -0,0 +1,183 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Finds the auto tanks' ways on open and dense maps with path::PathFinder, and with the
+// std::multimap search it replaced.
+#include "bench.h"
+#include "tank/path.h"
+#include "tank/tank.h"
+#include "tank/game_map.h"
+#include "tank/globals.h"
+#include <algorithm>
+#include <optional>
+#include <vector>
+#include <map>
+#include <set>
+#include <random>
+
+using namespace czh;
+
+namespace
+{
+  constexpr int area = 400;
+  constexpr std::size_t query_num = 3000;
+  constexpr int range = 15;
+
+  // The old search, as in AutoTank::target before the PathFinder.
+  class Node
+  {
+  public:
+    map::Pos pos;
+    map::Pos last;
+    int G;
+    bool root;
+
+    Node(const map::Pos &pos_, int G_, const map::Pos &last_, bool root_ = false)
+        : pos(pos_), last(last_), G(G_), root(root_) {}
+
+    [[nodiscard]] int get_F(const map::Pos &dest) const
+    {
+      return G + (int) map::get_distance(dest, pos) * 10;
+    }
+
+    [[nodiscard]] std::vector<Node> get_neighbors() const
+    {
+      if (G + 10 > 100) return {};
+      std::vector<Node> ret;
+      for (auto &p: {map::Pos{pos.x, pos.y + 1}, map::Pos{pos.x, pos.y - 1},
+                     map::Pos{pos.x - 1, pos.y}, map::Pos{pos.x + 1, pos.y}})
+      {
+        if (!g::game_map.has(map::Status::WALL, p) && !g::game_map.has(map::Status::TANK, p))
+          ret.emplace_back(p, G + 10, pos);
+      }
+      return ret;
+    }
+  };
+
+  std::optional<std::vector<tank::AutoTankEvent>>
+  multimap_find(const map::Pos &start, const map::Pos &dest, const std::set<map::Pos> &fire_line)
+  {
+    std::multimap<int, Node> open_list;
+    std::map<map::Pos, Node> close_list;
+    Node beg(start, 0, {0, 0}, true);
+    open_list.insert({beg.get_F(dest), beg});
+    while (!open_list.empty())
+    {
+      auto it = open_list.begin();
+      auto curr = close_list.insert({it->second.pos, it->second});
+      open_list.erase(it);
+      auto neighbors = curr.first->second.get_neighbors();
+      for (auto &node: neighbors)
+      {
+        if (close_list.find(node.pos) != close_list.end()) continue;
+        auto oit = std::find_if(open_list.begin(), open_list.end(),
+                                [&node](auto &&p) { return p.second.pos == node.pos; });
+        if (oit == open_list.end())
+        {
+          open_list.insert({node.get_F(dest), node});
+        }
+        else if (oit->second.G > node.G + 10)
+        {
+          oit->second.G = node.G + 10;
+          oit->second.last = node.pos;
+          int F = oit->second.get_F(dest);
+          auto n = open_list.extract(oit);
+          n.key() = F;
+          open_list.insert(std::move(n));
+        }
+      }
+      auto itt = std::find_if(open_list.begin(), open_list.end(),
+                              [&fire_line](auto &&p) { return fire_line.find(p.second.pos) != fire_line.end(); });
+      if (itt != open_list.end())
+      {
+        std::vector<tank::AutoTankEvent> way;
+        auto np = itt->second;
+        while (!np.root && np.pos != np.last)
+        {
+          way.insert(way.begin(), tank::get_pos_direction(close_list.at(np.last).pos, np.pos));
+          np = close_list.at(np.last);
+        }
+        return way;
+      }
+    }
+    return std::nullopt;
+  }
+
+  struct Query
+  {
+    map::Pos start;
+    map::Pos dest;
+    std::vector<map::Pos> fire_line;
+    std::set<map::Pos> fire_line_set; // for multimap_find
+  };
+}
+
+int main()
+{
+  std::mt19937 rng(1);
+  bool same = true;
+  for (int density: {0, 15, 35})
+  {
+    g::game_map.fill({-area / 2, area / 2, -area / 2, area / 2});
+    for (int x = -area / 2; x < area / 2; ++x)
+    {
+      for (int y = -area / 2; y < area / 2; ++y)
+      {
+        if (static_cast<int>(rng() % 100) < density)
+          g::game_map.fill({x, x + 1, y, y + 1}, map::Status::WALL);
+      }
+    }
+
+    std::vector<Query> queries;
+    while (queries.size() < query_num)
+    {
+      map::Pos start{static_cast<int>(rng() % (area / 2)) - area / 4,
+                     static_cast<int>(rng() % (area / 2)) - area / 4};
+      map::Pos target{start.x + static_cast<int>(rng() % (2 * range + 1)) - range,
+                      start.y + static_cast<int>(rng() % (2 * range + 1)) - range};
+      if (g::game_map.has(map::Status::WALL, start)) continue;
+      auto fire_line = tank::get_fire_line(range, target);
+      if (fire_line.empty()) continue;
+      auto dest = *std::min_element(fire_line.begin(), fire_line.end(), [&start](auto &&a, auto &&b)
+      {
+        return map::get_distance(a, start) < map::get_distance(b, start);
+      });
+      std::set<map::Pos> fire_line_set(fire_line.begin(), fire_line.end());
+      queries.push_back({start, dest, std::move(fire_line), std::move(fire_line_set)});
+    }
+
+    std::vector<std::optional<std::vector<tank::AutoTankEvent>>> multimap_ways;
+    std::vector<std::optional<std::vector<tank::AutoTankEvent>>> heap_ways;
+    auto multimap_ms = bench::time_ms([&] {
+      for (auto &q: queries)
+        multimap_ways.emplace_back(multimap_find(q.start, q.dest, q.fire_line_set));
+    });
+    auto heap_ms = bench::time_ms([&] {
+      for (auto &q: queries)
+        heap_ways.emplace_back(path::get_path_finder().find(q.start, q.dest, q.fire_line));
+    });
+
+    auto found = std::count_if(heap_ways.begin(), heap_ways.end(), [](auto &&w) { return w.has_value(); });
+    std::cout << density << "% walls, " << query_num << " queries, " << found << " ways found" << std::endl;
+    bench::report("multimap", multimap_ms);
+    bench::report("binary heap", heap_ms);
+    same = same && multimap_ways == heap_ways;
+  }
+  if (!same)
+  {
+    std::cout << "The ways differ." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests random firing lines with tank::is_in_firing_line, which scans the map's bitboards,
+// and with the loop it replaced, which looks up every point twice.
+#include "bench.h"
+#include "tank/tank.h"
+#include "tank/game_map.h"
+#include "tank/globals.h"
+#include <cstdlib>
+#include <vector>
+#include <random>
+
+using namespace czh;
+
+namespace
+{
+  constexpr int area = 200;
+  constexpr std::size_t tank_num = 150;
+  constexpr std::size_t segment_num = 200000;
+  constexpr int max_length = 30;
+
+  bool loop_is_in_firing_line(int range, const map::Pos &pos, const map::Pos &target_pos)
+  {
+    int x = target_pos.x - pos.x;
+    int y = target_pos.y - pos.y;
+    if (x == 0 && std::abs(y) > 0 && std::abs(y) < range)
+    {
+      int a = y > 0 ? pos.y : target_pos.y;
+      int b = y < 0 ? pos.y : target_pos.y;
+      for (int i = a + 1; i < b; ++i)
+      {
+        map::Pos tmp = {pos.x, i};
+        if (g::game_map.has(map::Status::WALL, tmp)
+            || g::game_map.has(map::Status::TANK, tmp))
+        {
+          return false;
+        }
+      }
+    }
+    else if (y == 0 && std::abs(x) > 0 && std::abs(x) < range)
+    {
+      int a = x > 0 ? pos.x : target_pos.x;
+      int b = x < 0 ? pos.x : target_pos.x;
+      for (int i = a + 1; i < b; ++i)
+      {
+        map::Pos tmp = {i, pos.y};
+        if (g::game_map.has(map::Status::WALL, tmp)
+            || g::game_map.has(map::Status::TANK, tmp))
+        {
+          return false;
+        }
+      }
+    }
+    else
+    {
+      return false;
+    }
+    return true;
+  }
+}
+
+int main()
+{
+  g::seed = 1;
+  g::game_map.reseed();
+
+  std::mt19937 rng(1);
+  auto random_pos = [&rng] { return map::Pos{static_cast<int>(rng() % area) - area / 2,
+                                             static_cast<int>(rng() % area) - area / 2}; };
+  for (std::size_t i = 0; i < tank_num;)
+  {
+    auto pos = random_pos();
+    if (g::game_map.has(map::Status::WALL, pos) || g::game_map.has(map::Status::TANK, pos)) continue;
+    g::game_map.add_tank(nullptr, pos);
+    ++i;
+  }
+
+  std::vector<std::pair<map::Pos, map::Pos>> segments;
+  for (std::size_t i = 0; i < segment_num; ++i)
+  {
+    auto pos = random_pos();
+    auto length = static_cast<int>(rng() % (2 * max_length + 1)) - max_length;
+    auto target = rng() % 2 == 0 ? map::Pos{pos.x + length, pos.y} : map::Pos{pos.x, pos.y + length};
+    segments.emplace_back(pos, target);
+  }
+
+  std::vector<bool> loop_results;
+  std::vector<bool> bit_results;
+  auto loop_ms = bench::time_ms([&] {
+    for (auto &[pos, target]: segments)
+      loop_results.emplace_back(loop_is_in_firing_line(max_length + 1, pos, target));
+  });
+  auto bit_ms = bench::time_ms([&] {
+    for (auto &[pos, target]: segments)
+      bit_results.emplace_back(tank::is_in_firing_line(max_length + 1, pos, target));
+  });
+
+  std::cout << segment_num << " segments of up to " << max_length << " points, "
+            << tank_num << " tanks in a " << area << "x" << area << " area" << std::endl;
+  bench::report("has() per point", loop_ms);
+  bench::report("bitboards", bit_ms);
+  if (loop_results != bit_results)
+  {
+    std::cout << "The results differ." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,251 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Moves tanks and bullets around and looks up random points, on map::Map and on the
+// std::map<Pos, Point> storage it had before the chunks.
+#include "bench.h"
+#include "tank/game_map.h"
+#include "tank/globals.h"
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <random>
+
+using namespace czh;
+
+namespace
+{
+  constexpr int area = 256;
+  constexpr std::size_t tank_num = 500;
+  constexpr std::size_t bullet_num = 5000;
+  constexpr std::size_t ticks = 200;
+  constexpr std::size_t lookups_per_tick = 10000;
+
+  // Directions as in map::Map::tank_move: up, down, left, right.
+  map::Pos step(const map::Pos &pos, int direction)
+  {
+    constexpr int dx[] = {0, 0, -1, 1};
+    constexpr int dy[] = {1, -1, 0, 0};
+    return {pos.x + dx[direction], pos.y + dy[direction]};
+  }
+
+  // The old storage, reduced to what the benchmark does. Points not in the tree are generated.
+  class TreeMap
+  {
+  private:
+    struct Point
+    {
+      std::vector<map::Status> statuses;
+      std::vector<bullet::BulletId> bullets;
+
+      [[nodiscard]] bool has(map::Status s) const
+      {
+        return std::find(statuses.cbegin(), statuses.cend(), s) != statuses.cend();
+      }
+
+      void remove_status(map::Status s)
+      {
+        auto it = std::find(statuses.begin(), statuses.end(), s);
+        if (it != statuses.end()) statuses.erase(it);
+      }
+    };
+
+    std::map<map::Pos, Point> points;
+  public:
+    [[nodiscard]] bool has(map::Status s, const map::Pos &pos) const
+    {
+      auto it = points.find(pos);
+      if (it != points.end()) return it->second.has(s);
+      return map::generate(pos, g::seed).has(s);
+    }
+
+    int add_tank(const map::Pos &pos)
+    {
+      points[pos].statuses.emplace_back(map::Status::TANK);
+      return 0;
+    }
+
+    int add_bullet(const bullet::BulletId &id, const map::Pos &pos)
+    {
+      auto &p = points[pos];
+      if (p.has(map::Status::WALL)) return -1;
+      p.statuses.emplace_back(map::Status::BULLET);
+      p.bullets.emplace_back(id);
+      return 0;
+    }
+
+    int tank_move(const map::Pos &pos, int direction)
+    {
+      auto new_pos = step(pos, direction);
+      if (has(map::Status::WALL, new_pos)) return -1;
+      auto &new_point = points[new_pos];
+      auto &old_point = points[pos];
+      if (new_point.has(map::Status::TANK)) return -1;
+      new_point.statuses.emplace_back(map::Status::TANK);
+      old_point.remove_status(map::Status::TANK);
+      if (old_point.statuses.empty()) points.erase(pos);
+      return 0;
+    }
+
+    int bullet_move(const bullet::BulletId &id, const map::Pos &pos, int direction)
+    {
+      auto new_pos = step(pos, direction);
+      if (has(map::Status::WALL, new_pos)) return -1;
+      auto &new_point = points[new_pos];
+      auto &old_point = points[pos];
+      old_point.bullets.erase(std::find(old_point.bullets.begin(), old_point.bullets.end(), id));
+      old_point.remove_status(map::Status::BULLET);
+      new_point.statuses.emplace_back(map::Status::BULLET);
+      new_point.bullets.emplace_back(id);
+      if (old_point.statuses.empty()) points.erase(pos);
+      return 0;
+    }
+  };
+
+  // map::Map with the same interface as TreeMap.
+  struct ChunkMap
+  {
+    map::Map m;
+
+    [[nodiscard]] bool has(map::Status s, const map::Pos &pos) const { return m.has(s, pos); }
+
+    int add_tank(const map::Pos &pos) { return m.add_tank(nullptr, pos); }
+
+    int add_bullet(const bullet::BulletId &id, const map::Pos &pos) { return m.add_bullet(id, pos); }
+
+    int tank_move(const map::Pos &pos, int direction)
+    {
+      switch (direction)
+      {
+        case 0:
+          return m.tank_up(pos);
+        case 1:
+          return m.tank_down(pos);
+        case 2:
+          return m.tank_left(pos);
+        default:
+          return m.tank_right(pos);
+      }
+    }
+
+    int bullet_move(const bullet::BulletId &id, const map::Pos &pos, int direction)
+    {
+      switch (direction)
+      {
+        case 0:
+          return m.bullet_up(id, pos);
+        case 1:
+          return m.bullet_down(id, pos);
+        case 2:
+          return m.bullet_left(id, pos);
+        default:
+          return m.bullet_right(id, pos);
+      }
+    }
+  };
+
+  struct Result
+  {
+    double fill_ms;
+    double move_ms;
+    double lookup_ms;
+    std::size_t checksum;
+  };
+
+  template<typename M>
+  Result run(M &m)
+  {
+    std::mt19937 rng(1);
+    auto random_pos = [&rng] { return map::Pos{static_cast<int>(rng() % area) - area / 2,
+                                               static_cast<int>(rng() % area) - area / 2}; };
+    std::vector<map::Pos> tanks;
+    std::vector<std::pair<map::Pos, int>> bullets;
+    Result ret{};
+
+    ret.fill_ms = bench::time_ms([&] {
+      while (tanks.size() < tank_num)
+      {
+        auto pos = random_pos();
+        if (m.has(map::Status::WALL, pos) || m.has(map::Status::TANK, pos)) continue;
+        m.add_tank(pos);
+        tanks.emplace_back(pos);
+      }
+      while (bullets.size() < bullet_num)
+      {
+        auto pos = random_pos();
+        if (m.has(map::Status::WALL, pos)) continue;
+        m.add_bullet({.slot = static_cast<std::uint32_t>(bullets.size()), .generation = 0}, pos);
+        bullets.emplace_back(pos, static_cast<int>(rng() % 4));
+      }
+    });
+
+    ret.move_ms = bench::time_ms([&] {
+      for (std::size_t t = 0; t < ticks; ++t)
+      {
+        for (auto &pos: tanks)
+        {
+          int direction = static_cast<int>(rng() % 4);
+          if (m.tank_move(pos, direction) == 0)
+          {
+            pos = step(pos, direction);
+            ++ret.checksum;
+          }
+        }
+        for (std::size_t i = 0; i < bullets.size(); ++i)
+        {
+          auto &[pos, direction] = bullets[i];
+          bullet::BulletId id{.slot = static_cast<std::uint32_t>(i), .generation = 0};
+          if (m.bullet_move(id, pos, direction) == 0)
+            pos = step(pos, direction);
+          else
+            direction ^= 1; // bounce back
+        }
+      }
+    });
+
+    ret.lookup_ms = bench::time_ms([&] {
+      for (std::size_t i = 0; i < ticks * lookups_per_tick; ++i)
+      {
+        auto pos = random_pos();
+        ret.checksum += m.has(map::Status::TANK, pos) + m.has(map::Status::BULLET, pos);
+      }
+    });
+    return ret;
+  }
+}
+
+int main()
+{
+  g::seed = 1;
+
+  TreeMap tree;
+  auto tree_result = run(tree);
+  ChunkMap chunks;
+  auto chunk_result = run(chunks);
+
+  std::cout << tank_num << " tanks, " << bullet_num << " bullets in a " << area << "x" << area << " area, "
+            << ticks << " ticks, " << lookups_per_tick << " lookups per tick" << std::endl;
+  bench::report("tree: fill", tree_result.fill_ms);
+  bench::report("tree: move", tree_result.move_ms);
+  bench::report("tree: lookup", tree_result.lookup_ms);
+  bench::report("chunks: fill", chunk_result.fill_ms);
+  bench::report("chunks: move", chunk_result.move_ms);
+  bench::report("chunks: lookup", chunk_result.lookup_ms);
+  if (tree_result.checksum != chunk_result.checksum)
+  {
+    std::cout << "The results differ." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Runs the game's ticks with 10k tanks, and prints the time of each tick and of its phases.
+// The path budget can be given as the argument.
+#include "bench.h"
+#include "tank/game.h"
+#include "tank/globals.h"
+#include "tank/profile.h"
+#include "tank/replay.h"
+#include "tank/path.h"
+#include <random>
+#include <string>
+
+using namespace czh;
+
+namespace
+{
+  constexpr int area = 400;
+  constexpr std::size_t tank_num = 10000;
+  constexpr std::size_t ticks = 50;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) g::path_budget = std::stoul(argv[1]);
+  g::seed = 1;
+  g::game_map.reseed();
+
+  std::mt19937 rng(1);
+  game::add_tank(map::Pos{0, 0});
+  while (g::tanks.size() < tank_num)
+  {
+    map::Pos pos{static_cast<int>(rng() % area) - area / 2, static_cast<int>(rng() % area) - area / 2};
+    if (g::game_map.has(map::Status::WALL, pos) || g::game_map.has(map::Status::TANK, pos)) continue;
+    game::add_auto_tank(1 + rng() % 10, pos);
+  }
+
+  auto ms = bench::time_ms([] {
+    for (std::size_t i = 0; i < ticks; ++i)
+      game::mainloop();
+  });
+
+  std::cout << tank_num << " tanks in a " << area << "x" << area << " area, " << ticks << " ticks, path budget "
+            << g::path_budget << std::endl;
+  bench::report("tick", ms / ticks);
+  for (auto phase: {profile::Phase::PATH, profile::Phase::AI, profile::Phase::BULLET,
+                    profile::Phase::COLLISION, profile::Phase::CLEAR_DEATH})
+  {
+    auto stats = profile::get_stats(phase);
+    bench::report(std::string(profile::get_name(phase)) + " (p50)",
+                  std::chrono::duration<double, std::milli>(stats.p50).count());
+  }
+  auto jobs = g::path_jobs.get_stats();
+  std::cout << "searches: " << jobs.queued << " queued, the oldest for " << jobs.oldest_wait << " ticks, "
+            << jobs.finished << " finished in the last tick" << std::endl;
+  std::cout << "state hash: " << replay::state_hash() << std::endl;
+  return 0;
+}
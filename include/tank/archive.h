@@ -0,0 +1,93 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_ARCHIVE_H
+#define TANK_ARCHIVE_H
+#pragma once
+
+#include "game_map.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <chrono>
+
+namespace czh::archive
+{
+  // World file, all the integers are little-endian:
+  //   header:    magic, version, seed, chunk count, directory offset, objects offset, objects size
+  //   directory: (chunk key, payload offset) of every chunk, sorted by key
+  //   payloads:  the used bitmap and the wall bitmap of a chunk, indexed by map::chunk_index
+  //   objects:   the next id, tanks and bullets, serialized by ser
+  constexpr std::uint32_t world_file_version = 2;
+  constexpr std::size_t chunk_bitmap_size = map::chunk_size * map::chunk_size / 8;
+  constexpr std::size_t chunk_payload_size = 2 * chunk_bitmap_size;
+  
+  inline bool test_bit(const unsigned char *bitmap, std::size_t index)
+  {
+    return bitmap[index >> 3] >> (index & 7) & 1;
+  }
+  
+  // A read-only world file. It is mapped into memory where possible, so its pages are only read
+  // when a chunk is touched, and opening a huge world costs almost nothing.
+  class WorldFile
+  {
+  private:
+    const unsigned char *data;
+    std::size_t size;
+    std::vector<unsigned char> buffer; // used where the file can't be mapped
+    std::size_t chunk_count;
+    std::size_t directory_offset;
+    std::size_t objects_offset;
+    std::size_t objects_size;
+  public:
+    WorldFile();
+    
+    WorldFile(const WorldFile &) = delete;
+    
+    WorldFile &operator=(const WorldFile &) = delete;
+    
+    ~WorldFile();
+    
+    // Returns nullptr if the file can't be read or isn't a world file.
+    static std::shared_ptr<const WorldFile> open(const std::string &path);
+    
+    [[nodiscard]] std::size_t get_seed() const;
+    
+    [[nodiscard]] std::size_t get_chunk_count() const;
+    
+    [[nodiscard]] std::uint64_t key_at(std::size_t i) const;
+    
+    [[nodiscard]] const unsigned char *payload_at(std::size_t i) const;
+    
+    // The payload of the chunk, or nullptr if the file doesn't have it.
+    [[nodiscard]] const unsigned char *find(std::uint64_t key) const;
+    
+    [[nodiscard]] std::string_view get_objects() const;
+  };
+  
+  int save(std::size_t user_id, const std::string &path);
+  
+  // Replaces the whole game with the saved one. Only the chunks that are touched will be read.
+  int load(std::size_t user_id, const std::string &path);
+  
+  // Starts moving the loaded chunks not seen since `before` to the spill file. The file is written
+  // on another thread, and finish_spill() swaps it in. Returns -1 if the last one isn't finished.
+  int spill(const std::vector<std::uint64_t> &keys, std::chrono::steady_clock::time_point before);
+  
+  // Once the spill file is written, makes it the map's backing and unloads the chunks that are
+  // still cold and unchanged. Waits for the file if `wait`.
+  void finish_spill(bool wait = false);
+}
+#endif
@@ -17,6 +17,9 @@
 
 #include "info.h"
 #include "game_map.h"
+#include <vector>
+#include <string>
+#include <cstdint>
 
 namespace czh::bullet
 {
@@ -28,44 +31,91 @@ namespace czh::bullet
     info::BulletInfo info;
   };
   
-  class Bullet;
-  
-  Bullet *build_bullet(const BulletData &data);
-  
-  BulletData get_bullet_data(Bullet *);
-  
-  
-  class Bullet
+  // The bullets of the current tick grouped by their points, in a flat open-addressing hash table,
+  // so that every point is looked up once instead of once per bullet.
+  class CollisionTable
   {
-    friend Bullet *build_bullet(const BulletData &data);
+  public:
+    struct Cell
+    {
+      map::Pos pos;
+      std::uint32_t first;   // the first bullet in the cell, followed by next_in_cell
+      std::uint32_t count;   // including the dead bullets
+      int lethality;         // of the alive bullets
+      bool resolved;
+    };
+  private:
+    std::vector<std::uint32_t> table; // index in `cells` + 1, or 0 if empty. The size is a power of 2.
+    std::vector<Cell> cells;
+    std::vector<std::uint32_t> cell_index; // indexed by the bullet's index
+    std::vector<std::uint32_t> next;       // indexed by the bullet's index
+  public:
+    // Clears the table for `bullet_count` bullets.
+    void reset(std::size_t bullet_count);
+    
+    void add(std::size_t bullet, const map::Pos &pos, int lethality, bool alive);
+    
+    [[nodiscard]] Cell &cell_of(std::size_t bullet);
     
-    friend BulletData get_bullet_data(Bullet *);
+    // The next bullet in the same cell, or `end` if there's none.
+    [[nodiscard]] std::uint32_t next_in_cell(std::size_t bullet) const;
+    
+    static constexpr std::uint32_t end = UINT32_MAX;
+  };
   
+  // All the bullets, stored as parallel arrays in the order they were fired, so that a tick
+  // walks them linearly. A bullet's index changes when the dead ones before it are removed,
+  // while its BulletId stays valid until it is removed itself.
+  class BulletPool
+  {
   private:
-    map::Pos pos;
-    map::Direction direction;
-    int from_tank_id;
-    info::BulletInfo info;
+    std::vector<map::Pos> pos;
+    std::vector<map::Direction> direction;
+    std::vector<int> hp;
+    std::vector<int> range;
+    std::vector<int> lethality;
+    std::vector<int> from_tank_id;
+    std::vector<BulletId> ids;
+    // Indexed by BulletId::slot.
+    std::vector<std::uint32_t> slot_index;
+    std::vector<std::uint32_t> slot_generation;
+    std::vector<std::uint32_t> free_slots;
+    CollisionTable collisions;
   public:
-    Bullet(info::BulletInfo info_, int from_tank_id_,
-           map::Pos pos_, map::Direction direction_)
-        : pos(pos_), direction(direction_), info(info_), from_tank_id(from_tank_id_) {}
+    BulletId add(const BulletData &data);
+    
+    [[nodiscard]] std::size_t size() const;
+    
+    [[nodiscard]] bool contains(const BulletId &id) const;
+    
+    [[nodiscard]] std::size_t index_of(const BulletId &id) const;
+    
+    [[nodiscard]] const map::Pos &get_pos(std::size_t i) const;
+    
+    [[nodiscard]] int get_tank(std::size_t i) const;
+    
+    [[nodiscard]] int get_lethality(std::size_t i) const;
     
-    int react();
+    [[nodiscard]] std::string get_text(std::size_t i) const;
     
-    std::string get_text();
+    [[nodiscard]] bool is_alive(std::size_t i) const;
     
-    [[nodiscard]] bool is_alive() const;
+    void kill(std::size_t i);
     
-    [[nodiscard]] int get_tank() const;
+    [[nodiscard]] BulletData get_data(std::size_t i) const;
     
-    void kill();
+    // Moves every alive bullet one step. A bullet hitting a wall bounces back and loses one hp.
+    // Every bullet is then added to the collision table, including the dead ones.
+    void react();
     
-    [[nodiscard]]const map::Pos &get_pos() const;
+    // Valid from react() to clear_death().
+    [[nodiscard]] CollisionTable &get_collisions();
     
-    map::Pos &get_pos();
+    // Removes the dead bullets from the map and the pool, keeping the order of the others.
+    void clear_death();
     
-    [[nodiscard]] int get_lethality() const;
+    // Removes all the bullets, but not from the map.
+    void clear();
   };
 }
-#endif
\ No newline at end of file
+#endif
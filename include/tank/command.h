@@ -16,6 +16,7 @@
 #pragma once
 
 #include "type_list.h"
+#include "game_map.h"
 #include <variant>
 #include <string>
 #include <vector>
@@ -35,6 +36,8 @@ namespace czh::cmd
     bool is_valid_id(int s);
 
     bool is_alive_id(int s);
+
+    void kill_in(const map::Zone &zone);
   }
 
   struct CommandInfo
@@ -20,6 +20,10 @@
 #include "utils.h"
 
 #include <string>
+#include <memory>
+#include <array>
+#include <bitset>
+#include <unordered_map>
 
 namespace czh::drawing
 {
@@ -67,13 +71,145 @@ namespace czh::drawing
     map::Direction direction;
     bool is_auto;
     bool is_alive;
+    
+    bool operator==(const TankView &) const = default;
   };
   
   struct Snapshot
   {
     MapView map;
     std::map<size_t, TankView> tanks;
-    std::set<map::Pos> changes;
+    std::vector<map::Zone> changes;
+    map::Zone zone; // where `map` was extracted
+  };
+  
+  // The published copy of a map chunk. `used` marks the points that differ from the generated
+  // terrain, `walls` marks the walls among them, and `objects` holds the tanks and bullets
+  // sorted by their index in the chunk.
+  struct ChunkView
+  {
+    std::bitset<map::chunk_size * map::chunk_size> used;
+    std::bitset<map::chunk_size * map::chunk_size> walls;
+    std::vector<std::pair<std::size_t, PointView>> objects;
+    
+    [[nodiscard]] const PointView &at(std::size_t index) const;
+  };
+  
+  // The map's changes in one version of the world. Only the recent ones are kept alive,
+  // so a reader that falls too far behind must redraw everything.
+  struct WorldChanges
+  {
+    std::size_t version;
+    bool overflowed; // the change journal was overwritten before being published
+    std::vector<map::Zone> zones;
+    std::weak_ptr<const WorldChanges> prev;
+  };
+  
+  // A hash table split into a fixed number of buckets, which are shared between the published
+  // worlds. A copy only copies the pointers, and a bucket is cloned when it is first changed,
+  // so publishing a world costs the buckets changed since the last one, not the whole table.
+  template<typename V>
+  class BucketTable
+  {
+  public:
+    using Bucket = std::unordered_map<std::uint64_t, V>;
+    static constexpr std::size_t bucket_count = 256;
+  private:
+    std::array<std::shared_ptr<Bucket>, bucket_count> buckets;
+    std::bitset<bucket_count> owned; // cloned by this table, so they can be changed in place
+  public:
+    BucketTable() = default;
+    
+    BucketTable(const BucketTable &other) : buckets(other.buckets), owned() {}
+    
+    BucketTable &operator=(const BucketTable &other)
+    {
+      buckets = other.buckets;
+      owned.reset();
+      return *this;
+    }
+    
+    // Fibonacci hashing, so that neighbouring chunks and consecutive ids are spread out.
+    static std::size_t bucket_of(std::uint64_t key)
+    {
+      return static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ull) >> 56);
+    }
+    
+    [[nodiscard]] const V *find(std::uint64_t key) const
+    {
+      auto &bucket = buckets[bucket_of(key)];
+      if (bucket == nullptr) return nullptr;
+      auto it = bucket->find(key);
+      return it == bucket->end() ? nullptr : &it->second;
+    }
+    
+    // nullptr if the bucket is empty.
+    [[nodiscard]] const Bucket *get_bucket(std::size_t i) const
+    {
+      return buckets[i] == nullptr || buckets[i]->empty() ? nullptr : buckets[i].get();
+    }
+    
+    void set(std::uint64_t key, V value)
+    {
+      get_mutable_bucket(bucket_of(key))[key] = std::move(value);
+    }
+    
+    void erase(std::uint64_t key)
+    {
+      auto i = bucket_of(key);
+      if (buckets[i] == nullptr || !buckets[i]->contains(key)) return;
+      get_mutable_bucket(i).erase(key);
+    }
+    
+    void set_bucket(std::size_t i, Bucket bucket)
+    {
+      buckets[i] = std::make_shared<Bucket>(std::move(bucket));
+      owned.set(i);
+    }
+    
+    template<typename F>
+    void for_each(F &&f) const
+    {
+      for (auto &bucket: buckets)
+      {
+        if (bucket == nullptr) continue;
+        for (auto &[key, value]: *bucket)
+        {
+          f(key, value);
+        }
+      }
+    }
+  
+  private:
+    Bucket &get_mutable_bucket(std::size_t i)
+    {
+      if (!owned[i])
+      {
+        buckets[i] = buckets[i] == nullptr ? std::make_shared<Bucket>() : std::make_shared<Bucket>(*buckets[i]);
+        owned.set(i);
+      }
+      return *buckets[i];
+    }
+  };
+  
+  // An immutable copy of the world published at the end of every tick. Unchanged chunks and
+  // tanks are shared with the previous version, so readers never need g::mainloop_mtx.
+  struct World
+  {
+    std::size_t version;
+    std::size_t seed;
+    BucketTable<std::shared_ptr<const ChunkView>> chunks;
+    std::shared_ptr<const archive::WorldFile> backing; // for the chunks not in `chunks`
+    BucketTable<TankView> tanks;
+    std::shared_ptr<const WorldChanges> changes;
+    
+    [[nodiscard]] MapView extract_map(const map::Zone &zone) const;
+    
+    [[nodiscard]] std::map<size_t, TankView> get_tanks() const;
+    
+    // Collects the changes after `since` clipped to `zone`.
+    // Returns false if some of them are no longer kept, then the reader must redraw everything.
+    bool read_changes(std::size_t since, const map::Zone &zone, std::vector<map::Zone> &ret) const;
   };
   
   extern PointView empty_point_view;
@@ -83,11 +219,14 @@ namespace czh::drawing
   
   const PointView &generate(int x, int y, size_t seed);
   
-  PointView extract_point(const map::Pos &pos);
+  PointView extract_point(const map::Point &point);
+  
+  TankView extract_tank(const tank::Tank *tank);
   
-  MapView extract_map(const map::Zone &zone);
+  // Publishes the current world, g::mainloop_mtx must be held.
+  void publish_world();
   
-  std::map<size_t, TankView> extract_tanks();
+  std::shared_ptr<const World> get_world();
   
   map::Zone get_visible_zone(size_t w, size_t h, size_t id);
   
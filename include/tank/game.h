@@ -25,6 +25,8 @@
 #include <chrono>
 #include <deque>
 #include <list>
+#include <atomic>
+#include <memory>
 
 namespace czh::game
 {
@@ -39,6 +41,54 @@ namespace czh::game
     TANK_STATUS,
     MAIN,
     HELP,
+    PROFILE,
+  };
+  
+  struct InputEvent
+  {
+    std::size_t tank_id;
+    tank::NormalTankEvent event;
+    std::size_t tick; // g::tick_count when it was received
+    std::chrono::steady_clock::time_point received; // only for the latency
+  };
+  
+  // A bounded lock-free queue of the players' inputs, pushed by any thread (the keyboard and the
+  // server's workers) and popped by the tick, after Dmitry Vyukov's bounded MPMC queue.
+  class InputQueue
+  {
+  private:
+    struct Slot
+    {
+      std::atomic<std::size_t> seq;
+      InputEvent event;
+    };
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    alignas(64) std::atomic<std::size_t> tail;
+    alignas(64) std::size_t head;
+    std::atomic<std::size_t> dropped;
+  public:
+    // The capacity must be a power of 2.
+    explicit InputQueue(std::size_t capacity);
+    
+    // Returns false and drops the event if the queue is full.
+    bool push(const InputEvent &event);
+    
+    // Only called by the thread holding mainloop_mtx.
+    bool pop(InputEvent &event);
+    
+    void clear();
+    
+    // The number of events dropped so far.
+    [[nodiscard]] std::size_t get_dropped() const;
+  };
+  
+  struct InputStats // of the last second
+  {
+    std::size_t applied = 0;
+    std::size_t coalesced = 0; // replaced by a later move, or a second fire in the same tick
+    std::chrono::microseconds avg_latency{0}; // from receiving to applying
+    std::chrono::microseconds max_latency{0};
   };
   
   std::optional<map::Pos> get_available_pos();
@@ -55,10 +105,18 @@ namespace czh::game
   
   std::size_t add_tank();
   
+  // Removes the tank of a user who left.
+  void remove_tank(std::size_t id);
+  
   void clear_death();
   
   void mainloop();
   
+  // Runs mainloop at a fixed timestep forever, and removes the clients that stop updating.
+  void run_mainloop();
+  
+  void remove_disconnected();
+  
   void tank_react(std::size_t id, tank::NormalTankEvent event);
   
   void quit();
@@ -16,6 +16,7 @@
 #pragma once
 
 #include "info.h"
+#include "utils.h"
 #include <vector>
 #include <list>
 #include <set>
@@ -25,14 +26,32 @@
 #include <map>
 #include <optional>
 #include <variant>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <unordered_map>
+#include <memory>
+#include <chrono>
 
 namespace czh::tank
 {
   class Tank;
 }
+namespace czh::archive
+{
+  class WorldFile;
+}
 namespace czh::bullet
 {
-  class Bullet;
+  // A bullet in bullet::BulletPool. The slot is reused after the bullet is removed, with
+  // another generation.
+  struct BulletId
+  {
+    std::uint32_t slot;
+    std::uint32_t generation;
+    
+    bool operator==(const BulletId &) const = default;
+  };
 }
 namespace czh::map
 {
@@ -72,25 +91,70 @@ namespace czh::map
     [[nodiscard]] bool contains(const Pos &p) const;
     
     [[nodiscard]] Zone bigger_zone(int i) const;
+    
+    [[nodiscard]] bool is_empty() const;
+    
+    [[nodiscard]] Zone intersect(const Zone &z) const;
+    
+    bool operator==(const Zone &z) const;
+  };
+  
+  bool operator<(const Zone &z1, const Zone &z2);
+  
+  struct Change
+  {
+    std::size_t tick;
+    Zone zone;
+  };
+  
+  // An append-only ring buffer of the map's changes, shared by all users.
+  // Every reader only keeps a cursor, which is the number of changes it has read.
+  class ChangeJournal
+  {
+  private:
+    std::vector<Change> ring;
+    std::size_t head;
+    std::size_t oldest;
+  public:
+    explicit ChangeJournal(std::size_t capacity);
+    
+    void add(const Zone &zone);
+    
+    [[nodiscard]] std::size_t end() const;
+    
+    // Makes every reader redraw everything, e.g. after the whole map is replaced.
+    void reset();
+    
+    // Collects the changed zones after `cursor` clipped to `zone`, and moves `cursor` to the end.
+    // Returns false if some of them have been overwritten, then the reader must redraw everything.
+    bool read(std::size_t &cursor, const Zone &zone, std::vector<Zone> &changes) const;
   };
   
   class Map;
   
+  using BulletList = utils::SmallVector<bullet::BulletId, 2>;
+  
   class Point
   {
     friend class Map;
   
   private:
-    bool generated;
-    bool temporary;
-    std::vector<Status> statuses;
+    // Occupancy of the point packed in one word. BULLET is counted by `bullets`.
+    enum Flag : std::uint8_t
+    {
+      GENERATED = 1 << 0,
+      TEMPORARY = 1 << 1,
+      WALL = 1 << 2,
+      TANK = 1 << 3
+    };
+    std::uint8_t flags;
     
     tank::Tank *tank;
-    std::vector<bullet::Bullet *> bullets;
+    BulletList bullets;
   public:
-    Point() : generated(false), temporary(true) {}
+    Point() : flags(TEMPORARY), tank(nullptr) {}
     
-    Point(const std::string &, std::vector<Status> s) : generated(true), statuses(std::move(s)), temporary(true) {}
+    Point(const std::string &, const std::vector<Status> &s);
     
     [[nodiscard]] bool is_generated() const;
     
@@ -100,7 +164,7 @@ namespace czh::map
     
     [[nodiscard]] tank::Tank *get_tank() const;
     
-    [[nodiscard]] const std::vector<bullet::Bullet *> &get_bullets() const;
+    [[nodiscard]] const BulletList &get_bullets() const;
     
     void add_status(const Status &status, void *);
     
@@ -116,14 +180,93 @@ namespace czh::map
   extern Point empty_point;
   extern Point wall_point;
   
+  // The map is stored in fixed-size square chunks. A chunk only holds the points
+  // that differ from the generated terrain, marked in `used`.
+  constexpr int chunk_shift = 5;
+  constexpr int chunk_size = 1 << chunk_shift;
+  
+  // Generated terrain of a chunk, bit x of rows[y] and bit y of cols[x] are set if (x, y) is a wall.
+  struct GeneratedChunk
+  {
+    std::array<std::uint32_t, chunk_size> rows;
+    std::array<std::uint32_t, chunk_size> cols;
+  };
+  
+  const GeneratedChunk &generate_chunk(int chunk_x, int chunk_y, size_t seed);
+  
   const Point &generate(const Pos &i, size_t seed);
   
   const Point &generate(int x, int y, size_t seed);
   
+  struct Chunk
+  {
+    std::array<Point, chunk_size * chunk_size> points;
+    std::bitset<chunk_size * chunk_size> used;
+    std::size_t used_count = 0;
+    // Bit x of blocked_rows[y] and bit y of blocked_cols[x] are set if (x, y) has a wall or a tank,
+    // including the generated walls of the points not used.
+    std::array<std::uint32_t, chunk_size> blocked_rows;
+    std::array<std::uint32_t, chunk_size> blocked_cols;
+    // The last time the chunk was in a user's view.
+    std::chrono::steady_clock::time_point last_seen;
+  };
+  
+  // A copy of a rectangle of the map's terrain, row by row.
+  struct Region
+  {
+    int width;
+    int height;
+    std::vector<bool> walls;
+  };
+  
+  // The most points copy() and paste() take at once, so that a command can't stall the tick.
+  constexpr std::int64_t max_region_size = 1 << 20;
+  
+  struct MapStats
+  {
+    std::size_t loaded_chunks;
+    std::size_t loaded_bytes;
+    std::size_t stored_chunks;
+    std::size_t compacted_points; // since the map was created
+    std::size_t spilled_chunks;   // since the map was created
+  };
+  
+  std::uint64_t chunk_key(int chunk_x, int chunk_y);
+  
+  std::uint64_t chunk_key(const Pos &pos);
+  
+  std::size_t chunk_index(const Pos &pos);
+  
+  // Calls f(key, part) for every chunk overlapping the zone, where `part` is the overlap.
+  template<typename F>
+  void for_each_chunk(const Zone &zone, F &&f)
+  {
+    if (zone.is_empty()) return;
+    for (int cx = zone.x_min >> chunk_shift; cx <= (zone.x_max - 1) >> chunk_shift; ++cx)
+    {
+      for (int cy = zone.y_min >> chunk_shift; cy <= (zone.y_max - 1) >> chunk_shift; ++cy)
+      {
+        Zone chunk_zone{cx * chunk_size, (cx + 1) * chunk_size, cy * chunk_size, (cy + 1) * chunk_size};
+        f(chunk_key(cx, cy), zone.intersect(chunk_zone));
+      }
+    }
+  }
+  
   class Map
   {
   private:
-    std::map<Pos, Point> map;
+    std::unordered_map<std::uint64_t, Chunk> chunks;
+    // Chunks of a world file. A stored chunk is loaded into `chunks` when it is modified,
+    // and is never erased after that, so the loaded one always overrides it.
+    std::shared_ptr<const archive::WorldFile> backing;
+    // Bumped from next_version whenever the blocked bits of a chunk change, and kept after the
+    // chunk is unloaded. Chunks without one are at `epoch`, which is bumped when the generated
+    // terrain changes.
+    std::unordered_map<std::uint64_t, std::uint64_t> versions;
+    std::uint64_t epoch;
+    std::uint64_t next_version;
+    std::size_t compacted_points;
+    std::size_t spilled_chunks;
   public:
     Map();
     
@@ -135,17 +278,17 @@ namespace czh::map
     
     int tank_right(const Pos &pos);
     
-    int bullet_up(bullet::Bullet *b, const Pos &pos);
+    int bullet_up(const bullet::BulletId &id, const Pos &pos);
     
-    int bullet_down(bullet::Bullet *b, const Pos &pos);
+    int bullet_down(const bullet::BulletId &id, const Pos &pos);
     
-    int bullet_left(bullet::Bullet *b, const Pos &pos);
+    int bullet_left(const bullet::BulletId &id, const Pos &pos);
     
-    int bullet_right(bullet::Bullet *b, const Pos &pos);
+    int bullet_right(const bullet::BulletId &id, const Pos &pos);
     
     int add_tank(tank::Tank *, const Pos &pos);
     
-    int add_bullet(bullet::Bullet *, const Pos &pos);
+    int add_bullet(const bullet::BulletId &id, const Pos &pos);
     
     void remove_status(const Status &status, const Pos &pos);
     
@@ -153,16 +296,77 @@ namespace czh::map
     
     [[nodiscard]] size_t count(const Status &status, const Pos &pos) const;
     
+    // The first x in [x_begin, x_end) where (x, y) has a wall or a tank, or x_end if there's none.
+    [[nodiscard]] int first_blocked_in_row(int y, int x_begin, int x_end) const;
+    
+    // The first y in [y_begin, y_end) where (x, y) has a wall or a tank, or y_end if there's none.
+    [[nodiscard]] int first_blocked_in_col(int x, int y_begin, int y_end) const;
+    
     int fill(const Zone &zone, const Status &status = Status::END);
     
+    // Restores the generated terrain in the zone. Tanks and bullets are kept.
+    void clear(const Zone &zone);
+    
+    [[nodiscard]] Region copy(const Zone &zone) const;
+    
+    void paste(const Region &region, const Pos &pos);
+    
     [[nodiscard]] const Point &at(const Pos &i) const;
     
+    // The latest version of the chunks overlapping the zone. It grows whenever a wall or a tank
+    // in any of them is added or removed, so anything read from the zone is still the same as long
+    // as its version is.
+    [[nodiscard]] std::uint64_t get_version(const Zone &zone) const;
+    
     [[nodiscard]] const Point &at(int x, int y) const;
+    
+    [[nodiscard]] const std::unordered_map<std::uint64_t, Chunk> &get_chunks() const;
+    
+    [[nodiscard]] const std::shared_ptr<const archive::WorldFile> &get_backing() const;
+    
+    // Replaces the whole map with the world file's.
+    void load(std::shared_ptr<const archive::WorldFile> file);
+    
+    // Marks the loaded chunks overlapping the zone as seen at `now`.
+    void see(const Zone &zone, std::chrono::steady_clock::time_point now);
+    
+    // Drops the temporary points left empty, and the chunks left empty. The edited points are
+    // kept. Returns the number of points dropped.
+    std::size_t compact();
+    
+    // The loaded chunks not seen since `before` and without any tank or bullet.
+    [[nodiscard]] std::vector<std::uint64_t> get_cold_chunks(std::chrono::steady_clock::time_point before) const;
+    
+    // Replaces the backing with `file`, which must have all the stored chunks and the given loaded
+    // ones, and unloads the given chunks.
+    void unload(const std::vector<std::uint64_t> &keys, std::shared_ptr<const archive::WorldFile> file);
+    
+    // Recomputes the blocked bits of the loaded chunks after the seed is changed.
+    void reseed();
+    
+    [[nodiscard]] MapStats get_stats() const;
   
   private:
+    [[nodiscard]] bool is_stored(std::uint64_t key) const;
+    
+    Chunk &load_chunk(std::uint64_t key);
+    
+    // Updates the blocked bits of the point after it is changed.
+    void refresh(Chunk &chunk, const Pos &pos);
+    
+    void refresh(const Pos &pos);
+    
+    [[nodiscard]] std::uint32_t blocked_row(int chunk_x, int chunk_y, int y) const;
+    
+    [[nodiscard]] std::uint32_t blocked_col(int chunk_x, int chunk_y, int x) const;
+    
+    Point &get(const Pos &pos);
+    
+    void erase(const Pos &pos);
+    
     int tank_move(const Pos &pos, int direction);
     
-    int bullet_move(bullet::Bullet *, const Pos &pos, int direction);
+    int bullet_move(const bullet::BulletId &id, const Pos &pos, int direction);
   };
 }
 #endif
\ No newline at end of file
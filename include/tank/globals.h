@@ -18,8 +18,12 @@
 #include "command.h"
 #include "game_map.h"
 #include "tank.h"
+#include "bullet.h"
 #include "online.h"
 #include "term.h"
+#include "profile.h"
+#include "replay.h"
+#include "path.h"
 #include <functional>
 #include <string>
 #include <set>
@@ -29,19 +33,23 @@
 #include <chrono>
 #include <queue>
 #include <list>
+#include <deque>
+#include <memory>
 
 namespace czh::g
 {
   struct UserData
   {
     size_t user_id;
-    std::set<map::Pos> map_changes;
+    std::size_t world_version = 0;
     std::priority_queue<msg::Message> messages;
     std::chrono::steady_clock::time_point last_update;
     std::string ip;
     int port;
     size_t screen_width;
     size_t screen_height;
+    map::Region clipboard;
+    map::Zone visible_zone; // the zone of the latest update
   };
   
   // game.cpp
@@ -51,13 +59,19 @@ namespace czh::g
   extern std::map<size_t, UserData> userdata;
   extern size_t user_id;
   extern size_t next_id;
+  extern std::atomic<std::size_t> tick_count;
   extern std::chrono::milliseconds tick;
   extern std::chrono::milliseconds msg_ttl;
+  extern std::chrono::minutes chunk_ttl;
+  extern int tps; // ticks actually run in the last second
+  extern std::chrono::steady_clock::time_point last_compaction;
   extern std::mutex mainloop_mtx;
-  extern std::mutex tank_reacting_mtx;
-  extern std::map<std::size_t, tank::Tank *> tanks;
-  extern std::list<bullet::Bullet *> bullets;
-  extern std::vector<std::pair<std::size_t, tank::NormalTankEvent>> normal_tank_events;
+  extern tank::TankRegistry tanks;
+  extern tank::TankIndex tank_index;
+  extern bullet::BulletPool bullets;
+  extern game::InputQueue input_queue;
+  extern game::InputStats input_stats;
+  extern online::Thpool ai_pool; // plans the auto tanks
   
   // term.cpp
   extern term::KeyBoard keyboard;
@@ -74,6 +88,7 @@ namespace czh::g
   
   // command.cpp
   extern const std::set<std::string> client_cmds;
+  extern const std::set<std::string> world_cmds; // run under mainloop_mtx as a whole
   extern const std::vector<cmd::CommandInfo> commands;
 
   // drawing.cpp
@@ -88,6 +103,9 @@ namespace czh::g
   extern std::size_t screen_width;
   extern int fps;
   extern drawing::Snapshot snapshot;
+  extern std::atomic<std::shared_ptr<const drawing::World>> world;
+  extern std::deque<std::shared_ptr<const drawing::WorldChanges>> world_history;
+  extern std::size_t world_cursor;
   extern std::chrono::steady_clock::time_point last_drawing;
   extern std::chrono::steady_clock::time_point last_message_displayed;
   extern drawing::PointView empty_point_view;
@@ -97,15 +115,33 @@ namespace czh::g
   
   // game_map.cpp
   extern map::Map game_map;
+  extern map::ChangeJournal change_journal;
   extern unsigned long long seed;
   extern map::Point empty_point;
   extern map::Point wall_point;
   
+  // archive.cpp
+  extern std::string spill_path;
+  
   // online.cpp
   extern online::TankServer online_server;
   extern online::TankClient online_client;
   extern std::mutex online_mtx;
   extern int client_failed_attempts;
   extern int delay; // ms
+  extern std::size_t max_clients; // 0 for unlimited
+  
+  // profile.cpp
+  extern std::array<profile::Histogram, profile::phase_count> profile_histograms;
+  
+  // replay.cpp
+  extern replay::Recorder recorder;
+  extern replay::Replayer replayer;
+  
+  // path.cpp
+  extern path::FlowFields flow_fields;
+  extern path::PathCache path_cache;
+  extern path::PathJobs path_jobs;
+  extern std::size_t path_budget;
 }
 #endif
\ No newline at end of file
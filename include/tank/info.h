@@ -25,6 +25,8 @@ namespace czh::info
     int hp;
     int lethality;
     int range;
+    
+    bool operator==(const BulletInfo &) const = default;
   };
   enum class TankType
   {
@@ -38,6 +40,8 @@ namespace czh::info
     int gap;
     TankType type;
     BulletInfo bullet;
+    
+    bool operator==(const TankInfo &) const = default;
   };
   
 }
@@ -186,6 +186,8 @@ namespace czh::online
     std::function<void(const Req &, Res &)> router;
     std::vector<Socket_t> sockets;
     Thpool thpool;
+    std::atomic<std::size_t> connections;
+    std::size_t max_connections; // 0 for unlimited
   public:
     TCPServer();
     
@@ -198,6 +200,8 @@ namespace czh::online
     void start(int port);
     
     void stop();
+    
+    void set_max_connections(std::size_t n);
   };
   
   class TCPClient
@@ -0,0 +1,276 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_PATH_H
+#define TANK_PATH_H
+#pragma once
+
+#include "game_map.h"
+#include "tank.h"
+#include <array>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <optional>
+#include <cstdint>
+
+namespace czh::path
+{
+  // A way costs 10 a step and at most 100, so a search never leaves the window of max_steps
+  // around its start.
+  constexpr int step_cost = 10;
+  constexpr int max_cost = 100;
+  constexpr int max_steps = max_cost / step_cost;
+  constexpr int window_size = 2 * max_steps + 1;
+
+  // A* for the auto tanks. The open list is an indexed binary heap ordered by (F, order of
+  // insertion), and the nodes live in a flat grid over the window, so a search allocates nothing.
+  class PathFinder
+  {
+  private:
+    struct Cell
+    {
+      std::uint32_t search; // the cell is unvisited if it was last touched by another search
+      int G;
+      int F;
+      std::uint32_t order; // breaks the ties of F, the earlier first
+      int parent; // the index of the cell, -1 for the start
+      int heap_index; // -1 if not in the open list
+      bool closed;
+      bool goal;
+    };
+    std::array<Cell, window_size * window_size> cells;
+    std::vector<int> heap;
+    std::uint32_t search;
+    std::uint32_t order;
+    map::Pos start;
+    map::Pos dest;
+    std::optional<std::vector<tank::AutoTankEvent>> result;
+  public:
+    PathFinder();
+
+    // The way from start to the first goal that gets into the open list, or nullopt if no goal
+    // can be reached.
+    std::optional<std::vector<tank::AutoTankEvent>>
+    find(const map::Pos &start_, const map::Pos &dest_, const std::vector<map::Pos> &goals);
+    
+    // The same search as find(), but run by resume() a few nodes at a time.
+    void begin(const map::Pos &start_, const map::Pos &dest_, const std::vector<map::Pos> &goals);
+    
+    // Expands at most `budget` nodes and takes them from it. Returns true once the search is over,
+    // and its way is in get_result().
+    bool resume(std::size_t &budget);
+    
+    std::optional<std::vector<tank::AutoTankEvent>> &get_result();
+
+  private:
+    [[nodiscard]] int get_H(const map::Pos &pos) const;
+    
+    [[nodiscard]] int index_of(const map::Pos &pos) const;
+
+    [[nodiscard]] map::Pos pos_of(int index) const;
+
+    Cell &touch(int index);
+
+    [[nodiscard]] bool before(int a, int b) const;
+
+    void push(int index);
+
+    int pop();
+
+    void sift_up(std::size_t i);
+
+    void sift_down(std::size_t i);
+  };
+
+  // A finder for one-shot searches outside the game, e.g. the benchmarks. The game searches
+  // through g::path_jobs.
+  PathFinder &get_path_finder();
+  
+  // The points a search from start can read.
+  map::Zone get_window(const map::Pos &start);
+  
+  // The start, the target and the bullet range.
+  using PathKey = std::tuple<map::Pos, map::Pos, int>;
+  
+  struct CachedWay
+  {
+    map::Pos dest;
+    std::optional<std::vector<tank::AutoTankEvent>> way;
+  };
+  
+  struct PathCacheStats
+  {
+    std::size_t entries;
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t stale; // misses of an entry whose version is out of date
+  };
+  
+  // Beyond that the cache is emptied.
+  constexpr std::size_t path_cache_capacity = 1 << 16;
+  
+  // The ways PathFinder found, with the version of the map they were found from. An entry is only
+  // used while the version is the same, so a hit is always what a new search would find.
+  // The planning threads share it.
+  class PathCache
+  {
+  private:
+    struct Entry
+    {
+      std::uint64_t version;
+      CachedWay result;
+    };
+    mutable std::mutex mtx;
+    std::map<PathKey, Entry> entries;
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t stale;
+  public:
+    PathCache();
+    
+    std::optional<CachedWay> find(const PathKey &key, std::uint64_t version);
+    
+    void insert(const PathKey &key, std::uint64_t version, CachedWay result);
+    
+    [[nodiscard]] PathCacheStats get_stats() const;
+  };
+  
+  // A target is hot if at least this many auto tanks are chasing it.
+  constexpr std::size_t hot_chasers = 4;
+  // Targets of longer ranges have too large a window, and are always left to PathFinder.
+  constexpr int max_field_range = 64;
+  
+  // The steps from every point near a target to its fire line, so all the auto tanks chasing the
+  // target read their ways from one breadth-first search instead of running their own.
+  class FlowField
+  {
+    friend class FlowFields;
+  private:
+    map::Pos target_pos;
+    int range;
+    int radius; // of the window around target_pos
+    std::uint64_t version; // of the window when it was built
+    std::size_t built_tick;
+    bool ready; // false from the time it goes stale until it is rebuilt
+    std::vector<int> steps; // -1 if the fire line can't be reached in max_steps
+  public:
+    FlowField();
+    
+    // Returns the number of points the search reached.
+    std::size_t build(const map::Pos &target_pos_, int range_);
+    
+    [[nodiscard]] const map::Pos &get_target_pos() const;
+    
+    // If the target has moved or the window has changed since the field was built.
+    [[nodiscard]] bool is_stale(const map::Pos &target_pos_) const;
+    
+    // The way from start to the fire line within max_steps, or nullopt if there's none.
+    // dest is set to the end of the way.
+    [[nodiscard]] std::optional<std::vector<tank::AutoTankEvent>>
+    find(const map::Pos &start, map::Pos &dest) const;
+  
+  private:
+    [[nodiscard]] map::Zone get_window() const;
+    
+    [[nodiscard]] int index_of(const map::Pos &pos) const;
+    
+    [[nodiscard]] int steps_at(const map::Pos &pos) const;
+  };
+  
+  // The flow fields of the hot targets, by target id and range. They are only changed by
+  // update() before the auto tanks plan, so the planning threads can read them without locks.
+  class FlowFields
+  {
+  private:
+    std::map<std::pair<std::size_t, int>, FlowField> fields;
+    std::size_t rebuilt;
+    std::size_t reached;
+  public:
+    FlowFields();
+    
+    // Drops the fields of the targets no longer hot, and builds the fields of the hot targets
+    // that are new or stale, the longest waiting first, until the points their searches reach
+    // use up the budget. The last one may go over it, and takes the rest.
+    void update(std::size_t &budget);
+    
+    // The field of the target with the range, or nullptr if the target isn't hot or its field is
+    // waiting to be rebuilt. The chasers search on their own then.
+    [[nodiscard]] const FlowField *get(std::size_t target_id, int range) const;
+    
+    // The fields rebuilt and the points their searches reached in the last tick.
+    [[nodiscard]] std::pair<std::size_t, std::size_t> get_rebuilt() const;
+    
+    [[nodiscard]] std::size_t size() const;
+    
+    void clear();
+  };
+  
+  // g::path_budget is the points searched in a tick, by the flow fields' rebuilds and then by the
+  // queued searches. The flow fields take at most half of it, and a search expands at most every
+  // point of its window, so one started with the rest always ends in the tick.
+  constexpr std::size_t default_path_budget = 4096;
+  constexpr std::size_t min_path_budget = 2 * window_size * window_size;
+  constexpr std::size_t max_path_budget = 1 << 20;
+  
+  struct PathJobStats
+  {
+    std::size_t queued;
+    std::size_t oldest_wait; // ticks since the oldest queued search was requested
+    std::size_t expanded; // in the last tick
+    std::size_t finished; // in the last tick
+    std::size_t total_wait; // ticks the searches finished in the last tick waited
+  };
+  
+  // The searches of the auto tanks that didn't hit a flow field or the cache. They are run in the
+  // order they were requested, before the auto tanks plan, until the tick's budget is used up, and
+  // the one cut off carries on in the next tick. The tanks keep their ways until their searches end.
+  class PathJobs
+  {
+  private:
+    struct Job
+    {
+      std::size_t tank_id;
+      map::Pos target_pos;
+      bool started;
+      // Of the search started, which is restarted if it is cut off and the world it read changes.
+      PathKey key;
+      std::uint64_t version;
+      map::Pos dest;
+    };
+    mutable std::mutex mtx;
+    std::map<std::pair<std::size_t, std::size_t>, Job> jobs; // by tick requested and tank id
+    std::map<std::size_t, std::pair<std::size_t, std::size_t>> queued; // tank id -> key in jobs
+    PathFinder finder;
+    std::size_t expanded;
+    std::size_t finished;
+    std::size_t total_wait;
+  public:
+    PathJobs();
+    
+    // A tank has at most one search queued, a later request only changes its target.
+    void request(std::size_t tank_id, const map::Pos &target_pos);
+    
+    // Drops the tank's queued search, e.g. once it has found a way some other way.
+    void cancel(std::size_t tank_id);
+    
+    // Expands at most `budget` nodes and takes them from it.
+    void run(std::size_t &budget);
+    
+    [[nodiscard]] PathJobStats get_stats() const;
+    
+    void clear();
+  };
+}
+#endif
@@ -0,0 +1,94 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_PROFILE_H
+#define TANK_PROFILE_H
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace czh::profile
+{
+  enum class Phase
+  {
+    TICK, INPUT, PATH, AI, BULLET, COLLISION, CLEAR_DEATH,
+    SNAPSHOT, DRAW,
+    TANK_REACT, UPDATE, REGISTER, DEREGISTER, ADD_AUTO_TANK, RUN_COMMAND, // server requests
+    END
+  };
+
+  constexpr std::size_t phase_count = static_cast<std::size_t>(Phase::END);
+
+  std::string_view get_name(Phase phase);
+
+  // The phase of a server request, or END if there's none.
+  Phase request_phase(std::string_view cmd);
+
+  struct Stats
+  {
+    std::size_t count;
+    std::chrono::nanoseconds p50;
+    std::chrono::nanoseconds p99;
+    std::chrono::nanoseconds max;
+  };
+
+  // Durations of the last few seconds, in log-scale buckets with 4 buckets per power of 2.
+  class Histogram
+  {
+  public:
+    static constexpr std::size_t bucket_count = 160;
+    static constexpr std::size_t window_count = 5; // a second each
+  private:
+    struct Window
+    {
+      std::int64_t second = -1;
+      std::array<std::uint32_t, bucket_count> buckets{};
+      std::size_t count = 0;
+      std::chrono::nanoseconds max{0};
+    };
+    std::array<Window, window_count> windows;
+    std::mutex mtx;
+  public:
+    void add(std::chrono::nanoseconds d);
+
+    // Of the last window_count seconds.
+    [[nodiscard]] Stats get_stats();
+  };
+
+  [[nodiscard]] Stats get_stats(Phase phase);
+
+  // Writes the stats of every phase to the file.
+  int dump(const std::string &path);
+
+  // Adds the time from its construction to its destruction to the phase.
+  class Timer
+  {
+  private:
+    Phase phase;
+    std::chrono::steady_clock::time_point beg;
+  public:
+    explicit Timer(Phase phase_);
+
+    Timer(const Timer &) = delete;
+
+    Timer &operator=(const Timer &) = delete;
+
+    ~Timer();
+  };
+}
+#endif
@@ -0,0 +1,106 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_REPLAY_H
+#define TANK_REPLAY_H
+#pragma once
+
+#include "game_map.h"
+#include "tank.h"
+#include <string>
+#include <deque>
+#include <fstream>
+#include <optional>
+#include <cstdint>
+
+namespace czh::replay
+{
+  // Replay file, all the integers are LEB128 varints, and the coordinates are zigzag-encoded:
+  //   header:  magic, version, seed, next id (tank-server reserves id 0 for the admin)
+  //   records: ticks since the last record, type, payload
+  //     INPUT:         tank id, event       (applied in the tick)
+  //     COMMAND:       user id, command     (run before the tick)
+  //     POS:           x, y                 (handed out by game::get_available_pos in the last command)
+  //     ADD_TANK:      id, x, y
+  //     ADD_AUTO_TANK: id, level, x, y
+  //     REMOVE_TANK:   id
+  //     END:           state hash           (after the last tick)
+  // Everything else in a game follows from the seed, so replaying the records gives the same world.
+  constexpr std::uint32_t replay_file_version = 2;
+
+  enum class RecordType : std::uint8_t
+  {
+    INPUT, COMMAND, POS, ADD_TANK, ADD_AUTO_TANK, REMOVE_TANK, END
+  };
+
+  // Records the changes to the world that don't follow from the seed. It is only called with
+  // g::mainloop_mtx held, so the records are in the same order as the changes.
+  class Recorder
+  {
+  private:
+    std::ofstream file;
+    std::string buffer;
+    std::size_t last_tick;
+    bool in_command;
+  public:
+    Recorder();
+
+    // Should be started before anything happens in the game.
+    int start(const std::string &path);
+
+    void stop();
+
+    [[nodiscard]] bool is_recording() const;
+
+    void input(std::size_t tank_id, tank::NormalTankEvent event);
+
+    void begin_command(std::size_t user_id, const std::string &command);
+
+    void end_command();
+
+    // Only the positions handed out in a command are recorded, the others are in their records.
+    void pos(const map::Pos &pos);
+
+    void add_tank(std::size_t id, const map::Pos &pos);
+
+    void add_auto_tank(std::size_t id, std::size_t lvl, const map::Pos &pos);
+
+    void remove_tank(std::size_t id);
+
+  private:
+    void begin_record(RecordType type);
+
+    void flush();
+  };
+
+  class Replayer
+  {
+  private:
+    bool replaying;
+    std::deque<map::Pos> positions; // of the running command
+  public:
+    Replayer();
+
+    // Replays the file on the fresh game as fast as possible.
+    int run(std::size_t user_id, const std::string &path);
+
+    [[nodiscard]] bool is_replaying() const;
+
+    // Instead of a random one.
+    std::optional<map::Pos> next_pos();
+  };
+
+  // Of the tanks and bullets.
+  std::uint64_t state_hash();
+}
+#endif
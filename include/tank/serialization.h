@@ -26,6 +26,8 @@
 #include <iterator>
 #include <bitset>
 #include <tuple>
+#include <cstring>
+#include <stdexcept>
 
 namespace czh::ser
 {
@@ -360,6 +362,8 @@ namespace czh::ser
     template<typename T>
     T internal_deserialize(trivially_copy_tag, const std::string &str)
     {
+      if (str.size() < sizeof(T))
+        throw std::out_of_range("Truncated data.");
       T item;
       std::memcpy(&item, str.data(), sizeof(T));
       return item;
@@ -24,6 +24,11 @@
 #include <utility>
 #include <variant>
 #include <functional>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <random>
+#include <type_traits>
 
 namespace czh::tank
 {
@@ -44,6 +49,7 @@ namespace czh::tank
     std::size_t target_id;
     map::Pos target_pos;
     map::Pos destination_pos;
+    bool targeted;
     std::vector<tank::AutoTankEvent> way;
     std::size_t waypos;
     int gap_count;
@@ -65,6 +71,7 @@ namespace czh::tank
     }
   };
   
+  // Adds the tank to g::tanks.
   Tank *build_tank(const TankData &data);
   
   TankData get_tank_data(Tank *);
@@ -84,8 +91,6 @@ namespace czh::tank
   public:
     Tank(info::TankInfo info_, map::Pos pos_);
     
-    virtual ~Tank() = default;
-    
     void kill();
     
     int up();
@@ -120,7 +125,7 @@ namespace czh::tank
     
     map::Pos &get_pos();
     
-    virtual void attacked(int lethality_);
+    void attacked(int lethality_);
     
     [[nodiscard]]const map::Pos &get_pos() const;
     
@@ -148,46 +153,49 @@ namespace czh::tank
     NormalTank(info::TankInfo info_, map::Pos pos_)
         : Tank(std::move(info_), pos_) {}
     
-    ~NormalTank() override = default;
+    void on_attacked() {}
   };
   
-  AutoTankEvent get_pos_direction(const map::Pos &from, const map::Pos &to);
-  
-  class Node
+  // A uniform grid of the tanks on the map, bucketed by map chunk.
+  class TankIndex
   {
   private:
-    map::Pos pos;
-    map::Pos last;
-    int G;
-    bool root;
+    std::unordered_map<std::uint64_t, std::vector<Tank *>> buckets;
   public:
-    Node() : G(0), root(false) {}
-    
-    Node(map::Pos pos_, int G_, const map::Pos &last_, bool root_ = false)
-        : pos(pos_), G(G_), last(last_), root(root_) {}
-    
-    Node(const Node &node) = default;
-    
-    [[nodiscard]]int get_F(const map::Pos &dest) const;
+    void insert(Tank *tank);
     
-    int &get_G();
+    void remove(Tank *tank);
     
-    map::Pos &get_last();
+    void move(Tank *tank, const map::Pos &from);
     
-    [[nodiscard]]const map::Pos &get_pos() const;
+    // Tanks in the zone, in no particular order.
+    [[nodiscard]] std::vector<Tank *> query(const map::Zone &zone) const;
     
-    [[nodiscard]]bool is_root() const;
+    // Tanks whose distance to `pos` is at most `radius`.
+    [[nodiscard]] std::vector<Tank *> query(const map::Pos &pos, int radius) const;
     
-    [[nodiscard]] std::vector<Node> get_neighbors() const;
-  
-  private:
-    bool check(map::Pos &pos) const;
+    // The nearest alive tank within `radius` except the one at `pos`, or nullptr.
+    [[nodiscard]] Tank *nearest(const map::Pos &pos, int radius) const;
   };
   
-  bool operator<(const Node &n1, const Node &n2);
+  AutoTankEvent get_pos_direction(const map::Pos &from, const map::Pos &to);
   
   bool is_in_firing_line(int range, const map::Pos &pos, const map::Pos &target_pos);
   
+  // The points in the firing line of target_pos, in order. Each of the four directions is scanned
+  // outwards from the target up to the range, stopping at the first wall or tank.
+  std::vector<map::Pos> get_fire_line(int range, const map::Pos &target_pos);
+  
+  // The version of the points get_fire_line reads.
+  std::uint64_t get_fire_line_version(int range, const map::Pos &target_pos);
+  
+  // What an auto tank decides to do in a tick.
+  struct AutoTankIntent
+  {
+    AutoTankEvent event = AutoTankEvent::PASS;
+    map::Direction direction = map::Direction::END; // to fire
+  };
+  
   class AutoTank : public Tank
   {
     friend Tank *build_tank(const TankData &data);
@@ -198,24 +206,151 @@ namespace czh::tank
     std::size_t target_id;
     map::Pos target_pos;
     map::Pos destination_pos;
+    bool targeted; // target_id is 0 until the tank targets someone
+    
+    // The fire line of fire_line_pos with fire_line_range, kept until the target moves or
+    // the points on it change.
+    std::vector<map::Pos> fire_line;
+    map::Pos fire_line_pos;
+    int fire_line_range;
+    std::uint64_t fire_line_version;
     
     std::vector<AutoTankEvent> way;
     std::size_t waypos;
     
     int gap_count;
-  public:
-    AutoTank(info::TankInfo info_, map::Pos pos_)
-        : Tank(std::move(info_), pos_), waypos(0), target_id(0), gap_count(0) {}
     
-    ~AutoTank() override = default;
+    // Seeded by the map's seed and the id, so the tank's choices don't depend on the other tanks.
+    std::minstd_rand rng;
+  public:
+    AutoTank(info::TankInfo info_, map::Pos pos_);
     
     void target(std::size_t target_id_, const map::Pos &target_pos_);
     
-    void react();
+    [[nodiscard]] bool has_target() const;
+    
+    [[nodiscard]] std::size_t get_target_id() const;
+    
+    // The fire line of target_pos_, where version is the current get_fire_line_version.
+    const std::vector<map::Pos> &get_fire_line(const map::Pos &target_pos_, std::uint64_t version);
     
-    void attacked(int lethality_) override;
+    // Called by path::PathJobs when the tank's search ends.
+    void take_way(const map::Pos &dest, std::optional<std::vector<AutoTankEvent>> found);
+    
+    // Only reads the world and changes the tank's own plan, so all the auto tanks can plan
+    // at the same time.
+    AutoTankIntent plan();
+    
+    void apply(const AutoTankIntent &intent);
+    
+    void on_attacked();
     
     void generate_random_way();
   };
+  
+  // Calls f with the tank as its own type. Tanks are dispatched by info::TankType instead of
+  // virtual functions, so every call is resolved at compile time.
+  template<typename F>
+  decltype(auto) visit(Tank *tank, F &&f)
+  {
+    if (tank->is_auto())
+    {
+      return std::forward<F>(f)(*static_cast<AutoTank *>(tank));
+    }
+    return std::forward<F>(f)(*static_cast<NormalTank *>(tank));
+  }
+  
+  // All the tanks, by id. Normal and auto tanks are kept in their own deques, which never move
+  // their elements, so the pointers held by the map and TankIndex stay valid. The place of a
+  // removed tank is reused by the next tank of the same type. Ids are never reused, so an id
+  // can't refer to another tank after its tank is removed.
+  class TankRegistry
+  {
+  private:
+    std::deque<NormalTank> normal_tanks;
+    std::deque<AutoTank> auto_tanks;
+    std::vector<std::size_t> free_normal_tanks;
+    std::vector<std::size_t> free_auto_tanks;
+    struct Entry
+    {
+      Tank *tank; // nullptr if the tank is removed
+      std::size_t place; // in its deque
+    };
+    std::vector<Entry> by_id;
+    std::size_t count;
+  public:
+    class Iterator
+    {
+    private:
+      std::vector<Entry>::const_iterator it;
+      std::vector<Entry>::const_iterator end;
+    public:
+      Iterator(std::vector<Entry>::const_iterator it_, std::vector<Entry>::const_iterator end_);
+      
+      Tank *operator*() const;
+      
+      Iterator &operator++();
+      
+      bool operator!=(const Iterator &i) const;
+    
+    private:
+      void skip();
+    };
+    
+    TankRegistry();
+    
+    TankRegistry(const TankRegistry &) = delete;
+    
+    TankRegistry &operator=(const TankRegistry &) = delete;
+    
+    NormalTank *add_normal(const info::TankInfo &info, const map::Pos &pos);
+    
+    AutoTank *add_auto(const info::TankInfo &info, const map::Pos &pos);
+    
+    // The tank must have been killed and cleared from the map.
+    void remove(std::size_t id);
+    
+    // Removes all the tanks, but not from the map.
+    void clear();
+    
+    // The tank with the id, or nullptr.
+    [[nodiscard]] Tank *at(std::size_t id) const;
+    
+    [[nodiscard]] std::size_t size() const;
+    
+    // In the order of the ids.
+    [[nodiscard]] Iterator begin() const;
+    
+    [[nodiscard]] Iterator end() const;
+    
+    // Calls f(T &) for every alive tank of the type T, which is NormalTank or AutoTank.
+    template<typename T, typename F>
+    void for_each_alive(F &&f)
+    {
+      for (auto &t: tanks_of<T>())
+      {
+        if (t.is_alive())
+        {
+          f(t);
+        }
+      }
+    }
+  
+  private:
+    void set(std::size_t id, Tank *tank, std::size_t place);
+    
+    template<typename T>
+    std::deque<T> &tanks_of()
+    {
+      if constexpr (std::is_same_v<T, AutoTank>)
+      {
+        return auto_tanks;
+      }
+      else
+      {
+        return normal_tanks;
+      }
+    }
+  };
 }
 #endif
\ No newline at end of file
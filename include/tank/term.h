@@ -42,6 +42,7 @@ namespace czh::term
   {
   public:
     int keyboard_mode;
+    bool active = false; // between init() and deinit()
 #if defined(CZH_TANK_KEYBOARD_MODE_0)
     DWORD initial_settings, new_settings;
 #elif defined(CZH_TANK_KEYBOARD_MODE_1)
@@ -20,6 +20,8 @@
 #include <stdexcept>
 #include <random>
 #include <type_traits>
+#include <algorithm>
+#include <cstdint>
 
 namespace czh::utils
 {
@@ -94,6 +96,125 @@ namespace czh::utils
   
   void tank_assert(bool b, const std::string &detail_ = "Assertion failed.");
   
+  // A vector that stores up to N elements inline and only allocates beyond that.
+  template<typename T, std::size_t N>
+  requires std::is_trivially_copyable_v<T>
+  class SmallVector
+  {
+  private:
+    std::uint32_t len;
+    std::uint32_t cap;
+    union
+    {
+      T local[N];
+      T *heap;
+    };
+  public:
+    SmallVector() : len(0), cap(N), local{} {}
+    
+    SmallVector(const SmallVector &v) : len(0), cap(N), local{}
+    {
+      for (auto &r: v) push_back(r);
+    }
+    
+    SmallVector(SmallVector &&v) noexcept: len(0), cap(N), local{}
+    {
+      swap(v);
+    }
+    
+    ~SmallVector()
+    {
+      if (cap > N) delete[] heap;
+    }
+    
+    SmallVector &operator=(const SmallVector &v)
+    {
+      if (this == &v) return *this;
+      clear();
+      for (auto &r: v) push_back(r);
+      return *this;
+    }
+    
+    SmallVector &operator=(SmallVector &&v) noexcept
+    {
+      if (this == &v) return *this;
+      clear();
+      swap(v);
+      return *this;
+    }
+    
+    void swap(SmallVector &v) noexcept
+    {
+      if (cap > N && v.cap > N)
+      {
+        std::swap(heap, v.heap);
+      }
+      else if (cap > N)
+      {
+        T *h = heap;
+        std::copy(v.local, v.local + v.len, local);
+        v.heap = h;
+      }
+      else if (v.cap > N)
+      {
+        T *h = v.heap;
+        std::copy(local, local + len, v.local);
+        heap = h;
+      }
+      else
+      {
+        for (std::size_t i = 0; i < N; ++i) std::swap(local[i], v.local[i]);
+      }
+      std::swap(len, v.len);
+      std::swap(cap, v.cap);
+    }
+    
+    T *data() { return cap > N ? heap : local; }
+    
+    const T *data() const { return cap > N ? heap : local; }
+    
+    T *begin() { return data(); }
+    
+    T *end() { return data() + len; }
+    
+    const T *begin() const { return data(); }
+    
+    const T *end() const { return data() + len; }
+    
+    [[nodiscard]] std::size_t size() const { return len; }
+    
+    [[nodiscard]] bool empty() const { return len == 0; }
+    
+    T &operator[](std::size_t i) { return data()[i]; }
+    
+    const T &operator[](std::size_t i) const { return data()[i]; }
+    
+    const T &back() const { return data()[len - 1]; }
+    
+    void push_back(const T &v)
+    {
+      if (len == cap)
+      {
+        auto new_cap = cap * 2;
+        T *h = new T[new_cap];
+        std::copy(begin(), end(), h);
+        if (cap > N) delete[] heap;
+        heap = h;
+        cap = new_cap;
+      }
+      data()[len++] = v;
+    }
+    
+    T *erase(T *it)
+    {
+      std::copy(it + 1, end(), it);
+      --len;
+      return it;
+    }
+    
+    void clear() { len = 0; }
+  };
+  
   template<typename T>
   requires (!std::is_same_v<std::string, std::decay_t<T>>) &&
            (!std::is_same_v<const char *, std::decay_t<T>>)
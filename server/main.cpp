@@ -0,0 +1,195 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// A dedicated server without any terminal: no keyboard, no drawing and no tank of its own.
+// Admin commands are read line by line from stdin or a file, and messages go to stdout.
+// It also replays recorded games as fast as possible, for benchmarks and regression checks.
+#include "tank/globals.h"
+#include "tank/command.h"
+#include "tank/game.h"
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <optional>
+
+using namespace czh;
+
+struct Options
+{
+  int port = 0;
+  std::optional<int> tick;
+  std::optional<int> seed;
+  std::size_t max_clients = 0;
+  std::string commands; // empty for stdin
+  std::string record;
+  std::string replay;
+};
+
+void usage(const char *name)
+{
+  std::cerr << "Usage: " << name << " --port <port> [options]\n"
+            << "       " << name << " --replay <file>\n"
+            << "  --port <port>          the server's port\n"
+            << "  --tick <ms>            minimum time of the mainloop (default: 16)\n"
+            << "  --seed <seed>          the map's seed (default: random)\n"
+            << "  --max-clients <n>      refuse more clients than n (default: 0, unlimited)\n"
+            << "  --commands <file>      read admin commands from the file instead of stdin\n"
+            << "  --record <file>        record the game to the file\n"
+            << "  --replay <file>        replay the recorded game, and print the ticks per second and its hash\n";
+}
+
+std::optional<Options> parse_options(int argc, char **argv)
+{
+  Options ret;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string opt = argv[i];
+    if (i + 1 >= argc) return std::nullopt;
+    std::string value = argv[++i];
+    try
+    {
+      if (opt == "--port") ret.port = std::stoi(value);
+      else if (opt == "--tick") ret.tick = std::stoi(value);
+      else if (opt == "--seed") ret.seed = std::stoi(value);
+      else if (opt == "--max-clients") ret.max_clients = std::stoull(value);
+      else if (opt == "--commands") ret.commands = value;
+      else if (opt == "--record") ret.record = value;
+      else if (opt == "--replay") ret.replay = value;
+      else return std::nullopt;
+    }
+    catch (...)
+    {
+      return std::nullopt;
+    }
+  }
+  if (!ret.replay.empty())
+  {
+    // Nothing else makes sense for a replay.
+    if (argc != 3) return std::nullopt;
+    return ret;
+  }
+  if (ret.port <= 0 || ret.port >= 65536 || (ret.tick.has_value() && *ret.tick <= 0)) return std::nullopt;
+  return ret;
+}
+
+// The admin is user 0. Its messages are printed instead of drawn.
+void print_messages()
+{
+  std::vector<std::string> lines;
+  {
+    std::lock_guard<std::mutex> l(g::mainloop_mtx);
+    auto &messages = g::userdata[0].messages;
+    while (!messages.empty())
+    {
+      lines.emplace_back(messages.top().content);
+      messages.pop();
+    }
+  }
+  for (auto &r: lines)
+  {
+    std::cout << r << std::endl;
+  }
+}
+
+void run_commands(std::istream &in)
+{
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (!line.empty() && line[0] == '/') line.erase(0, 1);
+    if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+    if (line == "quit")
+    {
+      print_messages();
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      game::quit();
+      std::exit(0);
+    }
+    cmd::run_command(0, line);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  auto options = parse_options(argc, argv);
+  if (!options.has_value())
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!options->replay.empty())
+  {
+    int ret = g::replayer.run(0, options->replay);
+    print_messages();
+    return ret == 0 ? 0 : 1;
+  }
+  // Id 0 is the admin's, who has no tank, so the clients' tanks start from 1.
+  g::next_id = 1;
+  if (options->tick.has_value())
+  {
+    cmd::run_command(0, "set tick " + std::to_string(*options->tick));
+  }
+  if (options->seed.has_value())
+  {
+    cmd::run_command(0, "set seed " + std::to_string(*options->seed));
+  }
+  g::max_clients = options->max_clients;
+  if (!options->record.empty() && g::recorder.start(options->record) != 0)
+  {
+    std::cerr << "Can not open " << options->record << "." << std::endl;
+    return 1;
+  }
+  cmd::run_command(0, "server start " + std::to_string(options->port));
+  print_messages();
+  if (g::game_mode != game::GameMode::SERVER)
+  {
+    return 1;
+  }
+
+  std::thread game_thread(game::run_mainloop);
+  game_thread.detach();
+  std::thread message_thread(
+      []
+      {
+        while (true)
+        {
+          print_messages();
+          std::this_thread::sleep_for(g::tick);
+        }
+      });
+  message_thread.detach();
+
+  if (!options->commands.empty())
+  {
+    std::ifstream file(options->commands);
+    if (!file.is_open())
+    {
+      std::cerr << "Can not open " << options->commands << "." << std::endl;
+      return 1;
+    }
+    run_commands(file);
+  }
+  else
+  {
+    run_commands(std::cin);
+  }
+  // Without more commands, keep serving.
+  while (true)
+  {
+    std::this_thread::sleep_for(std::chrono::hours(1));
+  }
+}
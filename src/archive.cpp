@@ -0,0 +1,531 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/archive.h"
+#include "tank/game_map.h"
+#include "tank/tank.h"
+#include "tank/bullet.h"
+#include "tank/message.h"
+#include "tank/serialization.h"
+#include "tank/globals.h"
+#include "tank/utils.h"
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <tuple>
+#include <future>
+#include <optional>
+
+namespace czh::g
+{
+  std::string spill_path;
+}
+
+namespace czh::archive
+{
+  constexpr char magic[8] = {'T', 'A', 'N', 'K', 'W', 'R', 'L', 'D'};
+  constexpr std::size_t header_size = 56;
+  constexpr std::size_t directory_entry_size = 16;
+
+  // TankData without the variant, which ser can't handle.
+  struct TankRecord
+  {
+    info::TankInfo info;
+    int hp;
+    map::Pos pos;
+    map::Direction direction;
+    bool hascleared;
+    bool is_auto;
+    tank::AutoTankData auto_data;
+  };
+
+  TankRecord make_record(const tank::TankData &data)
+  {
+    TankRecord ret{
+        .info = data.info,
+        .hp = data.hp,
+        .pos = data.pos,
+        .direction = data.direction,
+        .hascleared = data.hascleared,
+        .is_auto = data.is_auto(),
+        .auto_data = {}
+    };
+    if (data.is_auto())
+    {
+      ret.auto_data = std::get<tank::AutoTankData>(data.data);
+    }
+    return ret;
+  }
+
+  tank::TankData make_data(const TankRecord &record)
+  {
+    tank::TankData ret{
+        .info = record.info,
+        .hp = record.hp,
+        .pos = record.pos,
+        .direction = record.direction,
+        .hascleared = record.hascleared
+    };
+    if (record.is_auto)
+    {
+      ret.data.emplace<tank::AutoTankData>(record.auto_data);
+    }
+    return ret;
+  }
+
+  void write_u64(std::string &buf, std::uint64_t v)
+  {
+    for (int i = 0; i < 8; ++i)
+    {
+      buf += static_cast<char>(v >> (i * 8) & 0xff);
+    }
+  }
+
+  std::uint64_t read_u64(const unsigned char *p)
+  {
+    std::uint64_t ret = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+      ret |= static_cast<std::uint64_t>(p[i]) << (i * 8);
+    }
+    return ret;
+  }
+
+  WorldFile::WorldFile()
+      : data(nullptr), size(0), chunk_count(0), directory_offset(0), objects_offset(0), objects_size(0) {}
+
+  WorldFile::~WorldFile()
+  {
+#ifndef _WIN32
+    if (data != nullptr && buffer.empty())
+    {
+      munmap(const_cast<unsigned char *>(data), size);
+    }
+#endif
+  }
+
+  std::shared_ptr<const WorldFile> WorldFile::open(const std::string &path)
+  {
+    auto ret = std::make_shared<WorldFile>();
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return nullptr;
+    ret->buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    ret->data = ret->buffer.data();
+    ret->size = ret->buffer.size();
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(header_size))
+    {
+      ::close(fd);
+      return nullptr;
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    ret->data = static_cast<const unsigned char *>(addr);
+    ret->size = st.st_size;
+#endif
+    if (ret->size < header_size || std::memcmp(ret->data, magic, sizeof(magic)) != 0
+        || read_u64(ret->data + 8) != world_file_version)
+    {
+      return nullptr;
+    }
+    ret->chunk_count = read_u64(ret->data + 24);
+    ret->directory_offset = read_u64(ret->data + 32);
+    ret->objects_offset = read_u64(ret->data + 40);
+    ret->objects_size = read_u64(ret->data + 48);
+    if (ret->directory_offset > ret->size
+        || ret->chunk_count > (ret->size - ret->directory_offset) / directory_entry_size
+        || ret->objects_offset > ret->size || ret->objects_size > ret->size - ret->objects_offset)
+    {
+      return nullptr;
+    }
+    for (std::size_t i = 0; i < ret->chunk_count; ++i)
+    {
+      auto offset = read_u64(ret->data + ret->directory_offset + i * directory_entry_size + 8);
+      if (offset > ret->size || chunk_payload_size > ret->size - offset
+          || (i > 0 && ret->key_at(i - 1) >= ret->key_at(i)))
+      {
+        return nullptr;
+      }
+    }
+    return ret;
+  }
+
+  std::size_t WorldFile::get_seed() const
+  {
+    return read_u64(data + 16);
+  }
+
+  std::size_t WorldFile::get_chunk_count() const
+  {
+    return chunk_count;
+  }
+
+  std::uint64_t WorldFile::key_at(std::size_t i) const
+  {
+    return read_u64(data + directory_offset + i * directory_entry_size);
+  }
+
+  const unsigned char *WorldFile::payload_at(std::size_t i) const
+  {
+    return data + read_u64(data + directory_offset + i * directory_entry_size + 8);
+  }
+
+  const unsigned char *WorldFile::find(std::uint64_t key) const
+  {
+    std::size_t beg = 0;
+    std::size_t end = chunk_count;
+    while (beg < end)
+    {
+      auto mid = beg + (end - beg) / 2;
+      auto k = key_at(mid);
+      if (k == key)
+      {
+        return payload_at(mid);
+      }
+      else if (k < key)
+      {
+        beg = mid + 1;
+      }
+      else
+      {
+        end = mid;
+      }
+    }
+    return nullptr;
+  }
+
+  std::string_view WorldFile::get_objects() const
+  {
+    return {reinterpret_cast<const char *>(data + objects_offset), objects_size};
+  }
+
+  // The payload of a loaded chunk, or an empty string if it's all generated.
+  std::string make_payload(const map::Chunk &chunk)
+  {
+    std::string payload(chunk_payload_size, '\0');
+    bool empty = true;
+    for (std::size_t i = 0; i < chunk.points.size(); ++i)
+    {
+      // Temporary points only hold tanks or bullets, which are saved as objects.
+      if (!chunk.used[i] || chunk.points[i].is_temporary()) continue;
+      payload[i >> 3] = static_cast<char>(payload[i >> 3] | 1 << (i & 7));
+      if (chunk.points[i].has(map::Status::WALL))
+      {
+        payload[chunk_bitmap_size + (i >> 3)] = static_cast<char>(payload[chunk_bitmap_size + (i >> 3)] | 1 << (i & 7));
+      }
+      empty = false;
+    }
+    return empty ? "" : payload;
+  }
+
+  // Adds the stored chunks that are not loaded, which are still up to date.
+  void add_stored_chunks(std::vector<std::pair<std::uint64_t, std::string>> &chunks)
+  {
+    auto &backing = g::game_map.get_backing();
+    if (backing == nullptr) return;
+    for (std::size_t i = 0; i < backing->get_chunk_count(); ++i)
+    {
+      auto key = backing->key_at(i);
+      if (g::game_map.get_chunks().find(key) == g::game_map.get_chunks().end())
+      {
+        chunks.emplace_back(key, std::string(reinterpret_cast<const char *>(backing->payload_at(i)),
+                                             chunk_payload_size));
+      }
+    }
+  }
+
+  // Returns the error, or an empty string if the file is written.
+  std::string write_world(const std::string &path, std::size_t seed,
+                          std::vector<std::pair<std::uint64_t, std::string>> &chunks, const std::string &objects)
+  {
+    std::sort(chunks.begin(), chunks.end(),
+              [](auto &&a, auto &&b) { return a.first < b.first; });
+    std::size_t directory_offset = header_size;
+    std::size_t payload_offset = directory_offset + chunks.size() * directory_entry_size;
+    std::size_t objects_offset = payload_offset + chunks.size() * chunk_payload_size;
+    std::string buf(magic, sizeof(magic));
+    write_u64(buf, world_file_version);
+    write_u64(buf, seed);
+    write_u64(buf, chunks.size());
+    write_u64(buf, directory_offset);
+    write_u64(buf, objects_offset);
+    write_u64(buf, objects.size());
+    for (std::size_t i = 0; i < chunks.size(); ++i)
+    {
+      write_u64(buf, chunks[i].first);
+      write_u64(buf, payload_offset + i * chunk_payload_size);
+    }
+    for (auto &r: chunks)
+    {
+      buf += r.second;
+    }
+    buf += objects;
+
+    // Write to another file first, so the current one, which may be mapped, stays intact.
+    auto temp = path + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+      if (!out.write(buf.data(), static_cast<std::streamsize>(buf.size())))
+      {
+        return "Failed to write " + temp + ": " + std::strerror(errno);
+      }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (ec)
+    {
+      return "Failed to write " + path + ": " + ec.message();
+    }
+    return "";
+  }
+
+  int write_file(std::size_t user_id, const std::string &path,
+                 std::vector<std::pair<std::uint64_t, std::string>> &chunks, const std::string &objects)
+  {
+    if (auto error = write_world(path, g::seed, chunks, objects); !error.empty())
+    {
+      msg::error(user_id, error);
+      return -1;
+    }
+    return 0;
+  }
+
+  int save(std::size_t user_id, const std::string &path)
+  {
+    // Loaded chunks override the stored ones.
+    std::vector<std::pair<std::uint64_t, std::string>> chunks;
+    for (auto &[key, chunk]: g::game_map.get_chunks())
+    {
+      if (auto payload = make_payload(chunk); !payload.empty())
+      {
+        chunks.emplace_back(key, std::move(payload));
+      }
+    }
+    add_stored_chunks(chunks);
+
+    std::vector<TankRecord> tanks;
+    for (auto t: g::tanks)
+    {
+      tanks.emplace_back(make_record(tank::get_tank_data(t)));
+    }
+    std::vector<bullet::BulletData> bullets;
+    for (std::size_t i = 0; i < g::bullets.size(); ++i)
+    {
+      if (g::bullets.is_alive(i))
+      {
+        bullets.emplace_back(g::bullets.get_data(i));
+      }
+    }
+    return write_file(user_id, path, chunks, ser::serialize(g::next_id, tanks, bullets));
+  }
+
+  struct SpillResult
+  {
+    std::shared_ptr<const WorldFile> file;
+    std::string error;
+  };
+
+  // A spill file being written on another thread.
+  struct PendingSpill
+  {
+    std::vector<std::uint64_t> keys;
+    std::chrono::steady_clock::time_point before;
+    std::shared_ptr<const WorldFile> base; // the backing it was started with
+    std::future<SpillResult> result;
+  };
+
+  std::optional<PendingSpill> pending_spill;
+
+  // Runs on another thread, and only reads the backing, which is never changed.
+  SpillResult write_spill(std::vector<std::pair<std::uint64_t, std::string>> chunks,
+                          const std::vector<std::uint64_t> &sorted_keys, const std::string &objects,
+                          const std::shared_ptr<const WorldFile> &base, std::size_t seed, const std::string &path)
+  {
+    // The stored chunks that are not spilled again are still up to date.
+    if (base != nullptr)
+    {
+      for (std::size_t i = 0; i < base->get_chunk_count(); ++i)
+      {
+        auto key = base->key_at(i);
+        if (std::binary_search(sorted_keys.begin(), sorted_keys.end(), key)) continue;
+        chunks.emplace_back(key, std::string(reinterpret_cast<const char *>(base->payload_at(i)), chunk_payload_size));
+      }
+    }
+    if (auto error = write_world(path, seed, chunks, objects); !error.empty())
+    {
+      return {.file = nullptr, .error = error};
+    }
+    auto file = WorldFile::open(path);
+    if (file == nullptr)
+    {
+      return {.file = nullptr, .error = path + " can't be read back."};
+    }
+    return {.file = file, .error = ""};
+  }
+
+  int spill(const std::vector<std::uint64_t> &keys, std::chrono::steady_clock::time_point before)
+  {
+    if (pending_spill.has_value()) return -1;
+    if (g::spill_path.empty())
+    {
+      g::spill_path = (std::filesystem::temp_directory_path() / ("tank-" + std::to_string(
+          utils::randnum<unsigned long long>(0, ULLONG_MAX)) + ".spill")).string();
+    }
+    // Only the spilled chunks are read here, the stored ones are copied by write_spill.
+    std::vector<std::pair<std::uint64_t, std::string>> chunks;
+    for (auto &key: keys)
+    {
+      if (auto payload = make_payload(g::game_map.get_chunks().at(key)); !payload.empty())
+      {
+        chunks.emplace_back(key, std::move(payload));
+      }
+    }
+    auto sorted_keys = keys;
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+    // No objects, loading it only fails cleanly.
+    auto objects = ser::serialize(std::size_t(0), std::vector<TankRecord>{}, std::vector<bullet::BulletData>{});
+    auto &base = g::game_map.get_backing();
+    pending_spill.emplace(PendingSpill{
+        .keys = keys,
+        .before = before,
+        .base = base,
+        .result = std::async(std::launch::async, write_spill, std::move(chunks), std::move(sorted_keys),
+                             std::move(objects), base, g::seed, g::spill_path)
+    });
+    return 0;
+  }
+
+  void finish_spill(bool wait)
+  {
+    if (!pending_spill.has_value()) return;
+    if (!wait && pending_spill->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+    auto result = pending_spill->result.get();
+    auto spilled = std::move(*pending_spill);
+    pending_spill.reset();
+    if (result.file == nullptr)
+    {
+      msg::error(g::user_id, result.error);
+      return;
+    }
+    // The file has the chunks as they were when it was started. After a load, or if a chunk was
+    // dropped since, the file is out of date and is thrown away. The chunks are spilled again later.
+    auto &chunks = g::game_map.get_chunks();
+    if (g::game_map.get_backing() != spilled.base
+        || std::any_of(spilled.keys.begin(), spilled.keys.end(),
+                       [&chunks](auto &&key) { return chunks.find(key) == chunks.end(); }))
+    {
+      return;
+    }
+    // The chunks changed or seen since stay loaded, and override the file.
+    auto cold = g::game_map.get_cold_chunks(spilled.before);
+    std::sort(cold.begin(), cold.end());
+    std::vector<std::uint64_t> unloaded;
+    for (auto &key: spilled.keys)
+    {
+      if (!std::binary_search(cold.begin(), cold.end(), key)) continue;
+      auto payload = make_payload(chunks.at(key));
+      auto stored = result.file->find(key);
+      if (payload.empty() ? stored == nullptr
+                          : stored != nullptr && std::memcmp(stored, payload.data(), chunk_payload_size) == 0)
+      {
+        unloaded.emplace_back(key);
+      }
+    }
+    g::game_map.unload(unloaded, result.file);
+  }
+
+  int load(std::size_t user_id, const std::string &path)
+  {
+    auto file = WorldFile::open(path);
+    if (file == nullptr)
+    {
+      msg::error(user_id, path + " is not a valid world file.");
+      return -1;
+    }
+    std::size_t next_id;
+    std::vector<TankRecord> tanks;
+    std::vector<bullet::BulletData> bullets;
+    try
+    {
+      std::tie(next_id, tanks, bullets) = ser::deserialize<std::size_t, std::vector<TankRecord>,
+          std::vector<bullet::BulletData>>(std::string(file->get_objects()));
+    }
+    catch (...)
+    {
+      msg::error(user_id, path + " is not a valid world file.");
+      return -1;
+    }
+    if (std::find_if(tanks.begin(), tanks.end(),
+                     [](auto &&t) { return t.info.id == 0 && !t.is_auto; }) == tanks.end())
+    {
+      msg::error(user_id, path + " has no Tank 0.");
+      return -1;
+    }
+    std::vector<std::size_t> ids;
+    for (auto &r: tanks)
+    {
+      ids.emplace_back(r.info.id);
+    }
+    std::sort(ids.begin(), ids.end());
+    if (std::adjacent_find(ids.begin(), ids.end()) != ids.end() || ids.back() >= next_id)
+    {
+      msg::error(user_id, path + " is not a valid world file.");
+      return -1;
+    }
+
+    g::bullets.clear();
+    g::tanks.clear();
+    g::tank_index = tank::TankIndex{};
+    g::flow_fields.clear();
+    g::path_jobs.clear();
+    g::input_queue.clear();
+
+    g::seed = file->get_seed();
+    g::game_map.load(file);
+    g::change_journal.reset();
+
+    for (auto &r: tanks)
+    {
+      tank::build_tank(make_data(r));
+    }
+    for (auto &r: bullets)
+    {
+      // A bullet in a wall, e.g. in an edited file, would be in the pool but not on the map.
+      // It would have hit the wall anyway.
+      if (g::game_map.has(map::Status::WALL, r.pos)) continue;
+      g::game_map.add_bullet(g::bullets.add(r), r.pos);
+    }
+    g::next_id = next_id;
+    return 0;
+  }
+}
@@ -14,133 +14,244 @@
 #include "tank/globals.h"
 #include "tank/bullet.h"
 #include "tank/info.h"
+#include "tank/utils.h"
 
 namespace czh::bullet
 {
-  int Bullet::react()
+  void CollisionTable::reset(std::size_t bullet_count)
   {
-    int ret = -1;
-    switch (direction)
+    std::size_t size = 16;
+    while (size < bullet_count * 2) size <<= 1;
+    table.assign(size, 0);
+    cells.clear();
+    cell_index.resize(bullet_count);
+    next.resize(bullet_count);
+  }
+  
+  void CollisionTable::add(std::size_t bullet, const map::Pos &pos, int lethality, bool alive)
+  {
+    auto key = static_cast<std::uint64_t>(static_cast<std::uint32_t>(pos.x)) << 32
+               | static_cast<std::uint32_t>(pos.y);
+    auto mask = table.size() - 1;
+    auto h = static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (table[h] != 0 && cells[table[h] - 1].pos != pos)
     {
-      case map::Direction::UP:
-        ret = g::game_map.bullet_up(this, pos);
-        if (ret != 0)
-        {
-          info.hp -= 1;
-          direction = map::Direction::DOWN;
-        }
-        else
-        {
-          info.range -= 1;
-          pos.y++;
-        }
-        break;
-      case map::Direction::DOWN:
-        ret = g::game_map.bullet_down(this, pos);
-        if (ret != 0)
-        {
-          info.hp -= 1;
-          direction = map::Direction::UP;
-        }
-        else
-        {
-          info.range -= 1;
-          pos.y--;
-        }
-        break;
-      case map::Direction::LEFT:
-        ret = g::game_map.bullet_left(this, pos);
-        if (ret != 0)
-        {
-          info.hp -= 1;
-          direction = map::Direction::RIGHT;
-        }
-        else
-        {
-          info.range -= 1;
-          pos.x--;
-        }
-        break;
-      case map::Direction::RIGHT:
-        ret = g::game_map.bullet_right(this, pos);
-        if (ret != 0)
-        {
-          info.hp -= 1;
-          direction = map::Direction::LEFT;
-        }
-        else
-        {
-          info.range -= 1;
-          pos.x++;
-        }
-        break;
-      default:
-        break;
+      h = (h + 1) & mask;
     }
-    return ret;
-  }
-  
-  std::string Bullet::get_text()
-  {
-//    std::string ret;
-//    switch (direction)
-//    {
-//      case map::Direction::UP:
-//        break;
-//      case map::Direction::DOWN:
-//        break;
-//      case map::Direction::LEFT:
-//        break;
-//      case map::Direction::RIGHT:
-//        break;
-//    }
-    return "**";
+    if (table[h] == 0)
+    {
+      cells.emplace_back(Cell{.pos = pos, .first = end, .count = 0,
+                              .lethality = 0, .resolved = false});
+      table[h] = static_cast<std::uint32_t>(cells.size());
+    }
+    auto &cell = cells[table[h] - 1];
+    next[bullet] = cell.first;
+    cell.first = static_cast<std::uint32_t>(bullet);
+    ++cell.count;
+    if (alive)
+    {
+      cell.lethality += lethality;
+    }
+    cell_index[bullet] = table[h] - 1;
+  }
+  
+  CollisionTable::Cell &CollisionTable::cell_of(std::size_t bullet)
+  {
+    return cells[cell_index[bullet]];
+  }
+  
+  std::uint32_t CollisionTable::next_in_cell(std::size_t bullet) const
+  {
+    return next[bullet];
+  }
+  
+  BulletId BulletPool::add(const BulletData &data)
+  {
+    std::uint32_t slot;
+    if (free_slots.empty())
+    {
+      slot = static_cast<std::uint32_t>(slot_index.size());
+      slot_index.emplace_back(0);
+      slot_generation.emplace_back(0);
+    }
+    else
+    {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    slot_index[slot] = static_cast<std::uint32_t>(pos.size());
+    BulletId id{.slot = slot, .generation = slot_generation[slot]};
+    pos.emplace_back(data.pos);
+    direction.emplace_back(data.direction);
+    hp.emplace_back(data.info.hp);
+    range.emplace_back(data.info.range);
+    lethality.emplace_back(data.info.lethality);
+    from_tank_id.emplace_back(data.from_tank_id);
+    ids.emplace_back(id);
+    return id;
+  }
+  
+  std::size_t BulletPool::size() const
+  {
+    return pos.size();
+  }
+  
+  bool BulletPool::contains(const BulletId &id) const
+  {
+    return id.slot < slot_generation.size() && slot_generation[id.slot] == id.generation;
   }
   
-  [[nodiscard]] bool Bullet::is_alive() const
+  std::size_t BulletPool::index_of(const BulletId &id) const
   {
-    return info.hp > 0 && info.range > 0;
+    utils::tank_assert(contains(id), "Invalid bullet id.");
+    return slot_index[id.slot];
   }
   
-  [[nodiscard]] int Bullet::get_tank() const
+  const map::Pos &BulletPool::get_pos(std::size_t i) const
   {
-    return from_tank_id;
+    return pos[i];
   }
   
-  void Bullet::kill()
+  int BulletPool::get_tank(std::size_t i) const
   {
-    info.hp = 0;
+    return from_tank_id[i];
   }
   
-  [[nodiscard]]const map::Pos &Bullet::get_pos() const
+  int BulletPool::get_lethality(std::size_t i) const
   {
-    return pos;
+    return lethality[i];
   }
   
-  map::Pos &Bullet::get_pos()
+  std::string BulletPool::get_text(std::size_t) const
   {
-    return pos;
+    return "**";
   }
   
-  [[nodiscard]] int Bullet::get_lethality() const
+  bool BulletPool::is_alive(std::size_t i) const
   {
-    return info.lethality;
+    return hp[i] > 0 && range[i] > 0;
   }
   
-  Bullet *build_bullet(const BulletData &data)
+  void BulletPool::kill(std::size_t i)
   {
-    auto ret = new Bullet(data.info, data.from_tank_id, data.pos, data.direction);
-    return ret;
+    hp[i] = 0;
   }
   
-  BulletData get_bullet_data(Bullet *b)
+  BulletData BulletPool::get_data(std::size_t i) const
   {
     return BulletData
         {
-            .pos = b->pos,
-            .direction = b->direction,
-            .from_tank_id =  b->from_tank_id,
-            .info = b->info
+            .pos = pos[i],
+            .direction = direction[i],
+            .from_tank_id = from_tank_id[i],
+            .info = {.hp = hp[i], .lethality = lethality[i], .range = range[i]}
         };
   }
+  
+  void BulletPool::react()
+  {
+    for (std::size_t i = 0; i < pos.size(); ++i)
+    {
+      if (hp[i] <= 0 || range[i] <= 0) continue;
+      int ret;
+      map::Pos next = pos[i];
+      map::Direction back;
+      switch (direction[i])
+      {
+        case map::Direction::UP:
+          ret = g::game_map.bullet_up(ids[i], pos[i]);
+          next.y++;
+          back = map::Direction::DOWN;
+          break;
+        case map::Direction::DOWN:
+          ret = g::game_map.bullet_down(ids[i], pos[i]);
+          next.y--;
+          back = map::Direction::UP;
+          break;
+        case map::Direction::LEFT:
+          ret = g::game_map.bullet_left(ids[i], pos[i]);
+          next.x--;
+          back = map::Direction::RIGHT;
+          break;
+        case map::Direction::RIGHT:
+          ret = g::game_map.bullet_right(ids[i], pos[i]);
+          next.x++;
+          back = map::Direction::LEFT;
+          break;
+        default:
+          continue;
+      }
+      if (ret != 0)
+      {
+        hp[i] -= 1;
+        direction[i] = back;
+      }
+      else
+      {
+        range[i] -= 1;
+        pos[i] = next;
+      }
+    }
+    
+    collisions.reset(pos.size());
+    for (std::size_t i = 0; i < pos.size(); ++i)
+    {
+      collisions.add(i, pos[i], lethality[i], is_alive(i));
+    }
+  }
+  
+  CollisionTable &BulletPool::get_collisions()
+  {
+    return collisions;
+  }
+  
+  void BulletPool::clear_death()
+  {
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < pos.size(); ++i)
+    {
+      if (!is_alive(i))
+      {
+        g::game_map.remove_status(map::Status::BULLET, pos[i]);
+        ++slot_generation[ids[i].slot];
+        free_slots.emplace_back(ids[i].slot);
+        continue;
+      }
+      if (n != i)
+      {
+        pos[n] = pos[i];
+        direction[n] = direction[i];
+        hp[n] = hp[i];
+        range[n] = range[i];
+        lethality[n] = lethality[i];
+        from_tank_id[n] = from_tank_id[i];
+        ids[n] = ids[i];
+        slot_index[ids[n].slot] = static_cast<std::uint32_t>(n);
+      }
+      ++n;
+    }
+    pos.resize(n);
+    direction.resize(n);
+    hp.resize(n);
+    range.resize(n);
+    lethality.resize(n);
+    from_tank_id.resize(n);
+    ids.resize(n);
+  }
+  
+  void BulletPool::clear()
+  {
+    for (auto &id: ids)
+    {
+      ++slot_generation[id.slot];
+      free_slots.emplace_back(id.slot);
+    }
+    pos.clear();
+    direction.clear();
+    hp.clear();
+    range.clear();
+    lethality.clear();
+    from_tank_id.clear();
+    ids.clear();
+  }
 }
@@ -15,17 +15,25 @@
 #include "tank/game.h"
 #include "tank/term.h"
 #include "tank/command.h"
+#include "tank/archive.h"
+#include "tank/profile.h"
 #include <string>
 #include <vector>
 #include <mutex>
 #include <regex>
 #include <set>
+#include <climits>
+#include <cstdint>
 
 namespace czh::g
 {
   const std::set<std::string> client_cmds
   {
-    "fill", "tp", "kill", "clear", "summon", "revive", "set", "tell", "pause", "continue"
+    "fill", "copy", "paste", "tp", "kill", "clear", "summon", "revive", "set", "tell", "pause", "continue", "stats"
+  };
+  const std::set<std::string> world_cmds
+  {
+    "fill", "copy", "paste", "tp", "kill", "clear", "summon", "revive", "set", "pause", "continue"
   };
   const std::vector<cmd::CommandInfo> commands{
     {"help", "[line]"},
@@ -33,6 +41,12 @@ namespace czh::g
     {"connect", "[ip] [port]"},
     {"disconnect", ""},
     {"fill", "[status] [A x,y] [B x,y optional]"},
+    {"copy", "[A x,y] [B x,y]"},
+    {"paste", "[x,y]"},
+    {"save", "[path]"},
+    {"load", "[path]"},
+    {"stats", ""},
+    {"profile", "(dump [path optional])"},
     {"tp", "[A id] ([B id] or [B x,y])"},
     {"revive", "id"},
     {"summon", "[n] [level]"},
@@ -73,6 +87,32 @@ namespace czh::cmd
       if (!is_valid_id(id)) return false;
       return game::id_at(id)->is_alive();
     }
+
+    // Whether the rectangle from (from_x, from_y) to (to_x, to_y), both included, fits in a Zone
+    // and has at most map::max_region_size points.
+    bool is_region(int from_x, int from_y, int to_x, int to_y)
+    {
+      if ((std::max)(from_x, to_x) == INT_MAX || (std::max)(from_y, to_y) == INT_MAX) return false;
+      std::int64_t width = std::int64_t{(std::max)(from_x, to_x)} - (std::min)(from_x, to_x) + 1;
+      std::int64_t height = std::int64_t{(std::max)(from_y, to_y)} - (std::min)(from_y, to_y) + 1;
+      return width * height <= map::max_region_size;
+    }
+
+    void kill_in(const map::Zone &zone)
+    {
+      for (auto &t: g::tank_index.query(zone))
+      {
+        t->kill();
+      }
+      for (std::size_t i = 0; i < g::bullets.size(); ++i)
+      {
+        if (zone.contains(g::bullets.get_pos(i)))
+        {
+          g::bullets.kill(i);
+        }
+      }
+      game::clear_death();
+    }
   }
 
   CmdCall parse(const std::string &cmd)
@@ -125,18 +165,8 @@ namespace czh::cmd
     return CmdCall{.name = name, .args = args};
   }
 
-  void run_command(size_t user_id, const std::string &str)
+  void execute(size_t user_id, const CmdCall &call)
   {
-    auto call = parse(str);
-    if (g::game_mode == game::GameMode::CLIENT)
-    {
-      if (g::client_cmds.find(call.name) != g::client_cmds.end())
-      {
-        g::online_client.run_command(str);
-        return;
-      }
-    }
-
     if (call.is("help"))
     {
       if (call.args.empty())
@@ -184,22 +214,21 @@ namespace czh::cmd
     }
     else if (call.is("fill"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       int from_x;
       int from_y;
       int to_x;
       int to_y;
-      int is_wall = 0;
-      if (auto v = call.get_if<int, int, int>([](int w, int, int) { return w == 0 || w == 1; }); v)
+      int status = 0;
+      if (auto v = call.get_if<int, int, int>([](int s, int, int) { return s >= 0 && s <= 2; }); v)
       {
-        std::tie(is_wall, from_x, from_y) = *v;
+        std::tie(status, from_x, from_y) = *v;
         to_x = from_x;
         to_y = from_y;
       }
       else if (auto v = call.get_if<int, int, int, int, int>
-          ([](int w, int, int, int, int) { return w == 0 || w == 1; }); v)
+          ([](int s, int, int, int, int) { return s >= 0 && s <= 2; }); v)
       {
-        std::tie(is_wall, from_x, from_y, to_x, to_y) = *v;
+        std::tie(status, from_x, from_y, to_x, to_y) = *v;
       }
       else goto invalid_args;
 
@@ -208,31 +237,14 @@ namespace czh::cmd
         (std::min)(from_y, to_y), (std::max)(from_y, to_y) + 1
       };
 
-      for (int i = zone.x_min; i < zone.x_max; ++i)
+      helper::kill_in(zone);
+      if (status == 1)
       {
-        for (int j = zone.y_min; j < zone.y_max; ++j)
-        {
-          if (g::game_map.has(map::Status::TANK, {i, j}))
-          {
-            if (auto t = g::game_map.at(i, j).get_tank(); t != nullptr)
-            {
-              t->kill();
-            }
-          }
-          else if (g::game_map.has(map::Status::BULLET, {i, j}))
-          {
-            auto bullets = g::game_map.at(i, j).get_bullets();
-            for (auto &r: bullets)
-            {
-              r->kill();
-            }
-          }
-          game::clear_death();
-        }
+        g::game_map.fill(zone, map::Status::WALL);
       }
-      if (is_wall)
+      else if (status == 2)
       {
-        g::game_map.fill(zone, map::Status::WALL);
+        g::game_map.clear(zone);
       }
       else
       {
@@ -242,9 +254,146 @@ namespace czh::cmd
                          + std::to_string(from_y) + ") to (" + std::to_string(to_x) + "," + std::to_string(to_y) +
                          ").");
     }
-    else if (call.is("tp"))
+    else if (call.is("copy"))
+    {
+      if (auto v = call.get_if<int, int, int, int>(helper::is_region); v)
+      {
+        auto [from_x, from_y, to_x, to_y] = *v;
+        map::Zone zone = {
+          (std::min)(from_x, to_x), (std::max)(from_x, to_x) + 1,
+          (std::min)(from_y, to_y), (std::max)(from_y, to_y) + 1
+        };
+        g::userdata[user_id].clipboard = g::game_map.copy(zone);
+        msg::info(user_id, "Copied from (" + std::to_string(from_x) + ","
+                           + std::to_string(from_y) + ") to (" + std::to_string(to_x) + "," + std::to_string(to_y) +
+                           ").");
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("paste"))
+    {
+      if (auto v = call.get_if<int, int>([](int, int) { return true; }); v)
+      {
+        auto [x, y] = *v;
+        auto &clipboard = g::userdata[user_id].clipboard;
+        if (clipboard.walls.empty())
+        {
+          msg::error(user_id, "Nothing to paste.");
+          return;
+        }
+        if (std::int64_t{x} + clipboard.width > INT_MAX || std::int64_t{y} + clipboard.height > INT_MAX)
+          goto invalid_args;
+        helper::kill_in({x, x + clipboard.width, y, y + clipboard.height});
+        g::game_map.paste(clipboard, {x, y});
+        msg::info(user_id, "Pasted at (" + std::to_string(x) + "," + std::to_string(y) + ").");
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("save"))
     {
       std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      if (auto v = call.get_if<std::string>(
+        [](std::string) { return g::game_mode != game::GameMode::CLIENT; }); v)
+      {
+        auto [path] = *v;
+        if (archive::save(user_id, path) == 0)
+        {
+          msg::info(user_id, "Saved to " + path + ".");
+        }
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("load"))
+    {
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      if (auto v = call.get_if<std::string>(
+        [](std::string) { return g::game_mode == game::GameMode::NATIVE; }); v)
+      {
+        auto [path] = *v;
+        if (g::recorder.is_recording())
+        {
+          // The loaded world can't be replayed from the seed.
+          g::recorder.stop();
+          msg::warn(user_id, "Recording stopped.");
+        }
+        if (archive::load(user_id, path) == 0)
+        {
+          g::tank_focus = g::user_id;
+          g::output_inited = false;
+          msg::info(user_id, "Loaded " + path + ".");
+        }
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("stats"))
+    {
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      if (call.args.empty())
+      {
+        auto stats = g::game_map.get_stats();
+        msg::info(user_id, "Map: " + std::to_string(stats.loaded_chunks) + " chunks loaded ("
+                           + std::to_string(stats.loaded_bytes >> 10) + " KiB), "
+                           + std::to_string(stats.stored_chunks) + " stored.");
+        msg::info(user_id, "Compacted " + std::to_string(stats.compacted_points) + " points, spilled "
+                           + std::to_string(stats.spilled_chunks) + " chunks.");
+        msg::info(user_id, "Ticks per second: " + std::to_string(g::tps)
+                           + " (target " + std::to_string(1000 / g::tick.count()) + ").");
+        msg::info(user_id, "Tanks: " + std::to_string(g::tanks.size())
+                           + ", Bullets: " + std::to_string(g::bullets.size()) + ".");
+        auto [rebuilt, reached] = g::flow_fields.get_rebuilt();
+        msg::info(user_id, "Flow fields: " + std::to_string(g::flow_fields.size()) + " hot targets, "
+                           + std::to_string(rebuilt) + " rebuilt reaching " + std::to_string(reached)
+                           + " points in the last tick.");
+        auto path_stats = g::path_cache.get_stats();
+        auto lookups = path_stats.hits + path_stats.misses;
+        msg::info(user_id, "Path cache: " + std::to_string(path_stats.entries) + " entries, "
+                           + std::to_string(path_stats.hits) + " hits, "
+                           + std::to_string(path_stats.misses) + " misses ("
+                           + std::to_string(path_stats.stale) + " stale), hit rate "
+                           + std::to_string(lookups == 0 ? 0 : path_stats.hits * 100 / lookups) + "%.");
+        auto job_stats = g::path_jobs.get_stats();
+        msg::info(user_id, "Path searches: " + std::to_string(job_stats.queued) + " queued, the oldest for "
+                           + std::to_string(job_stats.oldest_wait) + " ticks, "
+                           + std::to_string(job_stats.finished) + " finished after "
+                           + std::to_string(job_stats.finished == 0 ? 0 : job_stats.total_wait / job_stats.finished)
+                           + " ticks avg and " + std::to_string(job_stats.expanded)
+                           + " nodes expanded in the last tick (budget " + std::to_string(g::path_budget) + ").");
+        msg::info(user_id, "Input: " + std::to_string(g::input_stats.applied) + " applied in the last second, "
+                           + "latency " + std::to_string(g::input_stats.avg_latency.count()) + " us avg, "
+                           + std::to_string(g::input_stats.max_latency.count()) + " us max, "
+                           + std::to_string(g::input_stats.coalesced) + " coalesced, "
+                           + std::to_string(g::input_queue.get_dropped()) + " dropped.");
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("profile"))
+    {
+      if (call.args.empty())
+      {
+        g::curr_page = game::Page::PROFILE;
+        g::output_inited = false;
+        return;
+      }
+      std::string path = "profile.txt";
+      if (auto v = call.get_if<std::string, std::string>(
+        [](std::string s, std::string) { return s == "dump"; }); v)
+      {
+        path = std::get<1>(*v);
+      }
+      else if (!call.get_if<std::string>([](std::string s) { return s == "dump"; }))
+        goto invalid_args;
+      
+      if (profile::dump(path) == 0)
+      {
+        msg::info(user_id, "Dumped the profile to " + path + ".");
+      }
+      else
+      {
+        msg::error(user_id, "Can not write to " + path + ".");
+      }
+    }
+    else if (call.is("tp"))
+    {
       int id = -1;
       map::Pos to_pos;
       auto check = [](const map::Pos &p)
@@ -281,20 +430,21 @@ namespace czh::cmd
       else goto invalid_args;
 
       g::game_map.remove_status(map::Status::TANK, game::id_at(id)->get_pos());
+      g::tank_index.remove(game::id_at(id));
       g::game_map.add_tank(game::id_at(id), to_pos);
       game::id_at(id)->get_pos() = to_pos;
+      g::tank_index.insert(game::id_at(id));
       msg::info(user_id, game::id_at(id)->get_name() + " was teleported to ("
                          + std::to_string(to_pos.x) + "," + std::to_string(to_pos.y) + ").");
     }
     else if (call.is("revive"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       int id;
       if (call.args.empty())
       {
-        for (auto &r: g::tanks)
+        for (auto t: g::tanks)
         {
-          if (!r.second->is_alive()) game::revive(r.second->get_id());
+          if (!t->is_alive()) game::revive(t->get_id());
         }
         msg::info(user_id, "Revived all tanks.");
         return;
@@ -309,7 +459,6 @@ namespace czh::cmd
     }
     else if (call.is("summon"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       int num, lvl;
       if (auto v = call.get_if<int, int>(
         [](int num, int lvl) { return num > 0 && lvl <= 10 && lvl >= 1; }); v)
@@ -337,12 +486,11 @@ namespace czh::cmd
     }
     else if (call.is("kill"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       if (call.args.empty())
       {
-        for (auto &r: g::tanks)
+        for (auto t: g::tanks)
         {
-          if (r.second->is_alive()) r.second->kill();
+          if (t->is_alive()) t->kill();
         }
         game::clear_death();
         msg::info(user_id, "Killed all tanks.");
@@ -359,34 +507,28 @@ namespace czh::cmd
     }
     else if (call.is("clear"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       if (call.args.empty())
       {
-        for (auto &r: g::bullets)
+        for (std::size_t i = 0; i < g::bullets.size(); ++i)
         {
-          if (game::id_at(r->get_tank())->is_auto())
+          if (game::id_at(g::bullets.get_tank(i))->is_auto())
           {
-            r->kill();
+            g::bullets.kill(i);
           }
         }
-        for (auto &r: g::tanks)
+        for (auto t: g::tanks)
         {
-          if (r.second->is_auto())
+          if (t->is_auto())
           {
-            r.second->kill();
+            t->kill();
           }
         }
         game::clear_death();
-        for (auto it = g::tanks.begin(); it != g::tanks.end();)
+        for (auto t: g::tanks)
         {
-          if (!it->second->is_auto())
-          {
-            ++it;
-          }
-          else
+          if (t->is_auto())
           {
-            delete it->second;
-            it = g::tanks.erase(it);
+            g::tanks.remove(t->get_id());
           }
         }
         msg::info(user_id, "Cleared all tanks.");
@@ -394,32 +536,27 @@ namespace czh::cmd
       else if (auto v = call.get_if<std::string>(
         [](std::string f) { return f == "death"; }); v)
       {
-        for (auto &r: g::bullets)
+        for (std::size_t i = 0; i < g::bullets.size(); ++i)
         {
-          auto t = game::id_at(r->get_tank());
+          auto t = game::id_at(g::bullets.get_tank(i));
           if (t->is_auto() && !t->is_alive())
           {
-            r->kill();
+            g::bullets.kill(i);
           }
         }
-        for (auto &r: g::tanks)
+        for (auto t: g::tanks)
         {
-          if (r.second->is_auto() && !r.second->is_alive())
+          if (t->is_auto() && !t->is_alive())
           {
-            r.second->kill();
+            t->kill();
           }
         }
         game::clear_death();
-        for (auto it = g::tanks.begin(); it != g::tanks.end();)
+        for (auto t: g::tanks)
         {
-          if (!it->second->is_auto() || it->second->is_alive())
-          {
-            ++it;
-          }
-          else
+          if (t->is_auto() && !t->is_alive())
           {
-            delete it->second;
-            it = g::tanks.erase(it);
+            g::tanks.remove(t->get_id());
           }
         }
         msg::info(user_id, "Cleared all died tanks.");
@@ -427,25 +564,23 @@ namespace czh::cmd
       else if (auto v = call.get_if<int>([](int id) { return helper::is_valid_id(id) || id != 0; }); v)
       {
         auto [id] = *v;
-        for (auto &r: g::bullets)
+        for (std::size_t i = 0; i < g::bullets.size(); ++i)
         {
-          if (r->get_tank() == id)
+          if (g::bullets.get_tank(i) == id)
           {
-            r->kill();
+            g::bullets.kill(i);
           }
         }
         auto t = game::id_at(id);
         t->kill();
-        delete t;
-        g::tanks.erase(id);
         game::clear_death();
+        g::tanks.remove(id);
         msg::info(user_id, "ID: " + std::to_string(id) + " was cleared.");
       }
       else goto invalid_args;
     }
     else if (call.is("set"))
     {
-      std::lock_guard<std::mutex> l(g::mainloop_mtx);
       if (auto v = call.get_if<int, std::string, int>(
         [](int id, std::string key, int value)
         {
@@ -481,7 +616,7 @@ namespace czh::cmd
             msg::error(user_id, "Invalid auto tank.");
             return;
           }
-          auto atank = dynamic_cast<tank::AutoTank *>(game::id_at(id));
+          auto atank = static_cast<tank::AutoTank *>(game::id_at(id));
           atank->target(value, game::id_at(value)->get_pos());
           msg::info(user_id, "The target of " + atank->get_name() + " was set to " + std::to_string(value) + ".");
           return;
@@ -504,7 +639,10 @@ namespace czh::cmd
         {
           return (key == "tick" && arg > 0)
                  || (key == "seed")
-                 || (key == "msg_ttl" && arg > 0);
+                 || (key == "msg_ttl" && arg > 0)
+                 || (key == "chunk_ttl" && arg > 0)
+                 || (key == "path_budget" && arg >= static_cast<int>(path::min_path_budget)
+                     && arg <= static_cast<int>(path::max_path_budget));
         }); v)
       {
         auto [option, arg] = *v;
@@ -516,6 +654,7 @@ namespace czh::cmd
         else if (option == "seed")
         {
           g::seed = arg;
+          g::game_map.reseed();
           g::output_inited = false;
           msg::info(user_id, "Seed was set to " + std::to_string(arg) + ".");
         }
@@ -524,6 +663,16 @@ namespace czh::cmd
           g::msg_ttl = std::chrono::milliseconds(arg);
           msg::info(user_id, "Msg_ttl was set to " + std::to_string(arg) + ".");
         }
+        else if (option == "chunk_ttl")
+        {
+          g::chunk_ttl = std::chrono::minutes(arg);
+          msg::info(user_id, "Chunk_ttl was set to " + std::to_string(arg) + ".");
+        }
+        else if (option == "path_budget")
+        {
+          g::path_budget = static_cast<std::size_t>(arg);
+          msg::info(user_id, "Path_budget was set to " + std::to_string(arg) + ".");
+        }
       }
       else if (auto v = call.get_if<int, std::string, std::string, int>(
         [](int id, std::string f, std::string key, int value)
@@ -580,10 +729,7 @@ namespace czh::cmd
         for (auto &r: g::userdata)
         {
           if (r.first == 0) continue;
-          g::tanks[r.first]->kill();
-          g::tanks[r.first]->clear();
-          delete g::tanks[r.first];
-          g::tanks.erase(r.first);
+          game::remove_tank(r.first);
         }
         g::userdata = {{0, g::userdata[0]}};
         g::game_mode = game::GameMode::NATIVE;
@@ -659,4 +805,30 @@ namespace czh::cmd
     msg::error(user_id, "Invalid arguments.");
     return;
   }
+
+  void run_command(size_t user_id, const std::string &str)
+  {
+    auto call = parse(str);
+    if (g::game_mode == game::GameMode::CLIENT)
+    {
+      if (g::client_cmds.find(call.name) != g::client_cmds.end())
+      {
+        g::online_client.run_command(str);
+        return;
+      }
+    }
+    
+    if (g::world_cmds.find(call.name) != g::world_cmds.end())
+    {
+      // Runs between two ticks as a whole, so it is recorded at the tick it takes effect.
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      g::recorder.begin_command(user_id, str);
+      execute(user_id, call);
+      g::recorder.end_command();
+    }
+    else
+    {
+      execute(user_id, call);
+    }
+  }
 }
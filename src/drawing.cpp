@@ -17,6 +17,8 @@
 #include "tank/term.h"
 #include "tank/drawing.h"
 #include "tank/globals.h"
+#include "tank/archive.h"
+#include "tank/profile.h"
 
 #include <mutex>
 #include <vector>
@@ -24,6 +26,9 @@
 #include <list>
 #include <iostream>
 #include <iomanip>
+#include <utility>
+#include <climits>
+#include <unordered_set>
 
 namespace czh::g
 {
@@ -37,6 +42,10 @@ namespace czh::g
   std::vector<std::string> help_text;
   map::Zone visible_zone = {-128, 128, -128, 128};
   drawing::Snapshot snapshot{};
+  std::atomic<std::shared_ptr<const drawing::World>> world = std::make_shared<const drawing::World>(
+      drawing::World{.version = 0, .seed = 0, .changes = std::make_shared<const drawing::WorldChanges>()});
+  std::deque<std::shared_ptr<const drawing::WorldChanges>> world_history;
+  std::size_t world_cursor = 0;
   int fps = 60;
   drawing::PointView empty_point_view{.status = map::Status::END, .tank_id = -1, .text = ""};
   drawing::PointView wall_point_view{.status = map::Status::WALL, .tank_id = -1, .text = ""};
@@ -93,25 +102,25 @@ namespace czh::drawing
     return view.empty();
   }
   
-  PointView extract_point(const map::Pos &p)
+  PointView extract_point(const map::Point &point)
   {
-    if (g::game_map.has(map::Status::TANK, p))
+    if (point.has(map::Status::TANK))
     {
       return {
           .status = map::Status::TANK,
-          .tank_id = static_cast<int>(g::game_map.at(p).get_tank()->get_id()),
+          .tank_id = static_cast<int>(point.get_tank()->get_id()),
           .text = ""
       };
     }
-    else if (g::game_map.has(map::Status::BULLET, p))
+    else if (point.has(map::Status::BULLET))
     {
       return {
           .status = map::Status::BULLET,
-          .tank_id = static_cast<int>(g::game_map.at(p).get_bullets()[0]->get_tank()),
-          .text = g::game_map.at(p).get_bullets()[0]->get_text()
+          .tank_id = g::bullets.get_tank(g::bullets.index_of(point.get_bullets()[0])),
+          .text = g::bullets.get_text(g::bullets.index_of(point.get_bullets()[0]))
       };
     }
-    else if (g::game_map.has(map::Status::WALL, p))
+    else if (point.has(map::Status::WALL))
     {
       return {
           .status = map::Status::WALL,
@@ -130,39 +139,215 @@ namespace czh::drawing
     return {};
   }
   
-  MapView extract_map(const map::Zone &zone)
+  TankView extract_tank(const tank::Tank *tank)
+  {
+    return {
+        .info = tank->get_info(),
+        .hp = tank->get_hp(),
+        .pos = tank->get_pos(),
+        .direction = tank->get_direction(),
+        .is_auto = tank->is_auto(),
+        .is_alive = tank->is_alive()
+    };
+  }
+  
+  const PointView &ChunkView::at(std::size_t index) const
+  {
+    auto it = std::lower_bound(objects.begin(), objects.end(), index,
+                               [](auto &&a, std::size_t b) { return a.first < b; });
+    if (it != objects.end() && it->first == index)
+    {
+      return it->second;
+    }
+    return walls[index] ? g::wall_point_view : g::empty_point_view;
+  }
+  
+  MapView World::extract_map(const map::Zone &zone) const
   {
     MapView ret;
-    ret.seed = g::seed;
-    for (int i = zone.x_min; i < zone.x_max; ++i)
+    ret.seed = seed;
+    map::for_each_chunk(zone, [this, &ret](std::uint64_t key, const map::Zone &part)
+    {
+      auto found = chunks.find(key);
+      if (found == nullptr)
+      {
+        auto payload = backing == nullptr ? nullptr : backing->find(key);
+        if (payload == nullptr) return;
+        for (int i = part.x_min; i < part.x_max; ++i)
+        {
+          for (int j = part.y_min; j < part.y_max; ++j)
+          {
+            auto index = map::chunk_index({i, j});
+            if (archive::test_bit(payload, index))
+            {
+              ret.view.insert(std::make_pair(map::Pos{i, j},
+                                             archive::test_bit(payload + archive::chunk_bitmap_size, index)
+                                             ? g::wall_point_view : g::empty_point_view));
+            }
+          }
+        }
+        return;
+      }
+      auto &chunk = **found;
+      for (int i = part.x_min; i < part.x_max; ++i)
+      {
+        for (int j = part.y_min; j < part.y_max; ++j)
+        {
+          auto index = map::chunk_index({i, j});
+          if (chunk.used[index])
+          {
+            ret.view.insert(std::make_pair(map::Pos{i, j}, chunk.at(index)));
+          }
+        }
+      }
+    });
+    return ret;
+  }
+  
+  std::map<size_t, TankView> World::get_tanks() const
+  {
+    std::map<size_t, TankView> ret;
+    tanks.for_each([&ret](std::uint64_t id, const TankView &view) { ret.emplace(id, view); });
+    return ret;
+  }
+  
+  bool World::read_changes(std::size_t since, const map::Zone &zone, std::vector<map::Zone> &ret) const
+  {
+    auto beg = ret.size();
+    auto curr = changes;
+    while (curr->version > since)
     {
-      for (int j = zone.y_min; j < zone.y_max; ++j)
+      if (curr->overflowed) return false;
+      for (auto &z: curr->zones)
       {
-        if (!g::game_map.at(i, j).is_generated())
+        auto clipped = z.intersect(zone);
+        if (!clipped.is_empty())
         {
-          ret.view.insert(std::make_pair(map::Pos{i, j}, extract_point({i, j})));
+          ret.emplace_back(clipped);
         }
       }
+      if (curr->version == since + 1) break;
+      curr = curr->prev.lock();
+      if (curr == nullptr) return false;
+    }
+    std::sort(ret.begin() + beg, ret.end());
+    ret.erase(std::unique(ret.begin() + beg, ret.end()), ret.end());
+    return true;
+  }
+  
+  std::shared_ptr<const ChunkView> extract_chunk(const map::Chunk &chunk)
+  {
+    auto ret = std::make_shared<ChunkView>();
+    ret->used = chunk.used;
+    for (std::size_t i = 0; i < chunk.points.size(); ++i)
+    {
+      if (!chunk.used[i]) continue;
+      auto &point = chunk.points[i];
+      if (point.has(map::Status::TANK) || point.has(map::Status::BULLET))
+      {
+        ret->objects.emplace_back(i, extract_point(point));
+      }
+      else if (point.has(map::Status::WALL))
+      {
+        ret->walls.set(i);
+      }
     }
     return ret;
   }
   
-  std::map<size_t, TankView> extract_tanks()
+  // Rebuilds the buckets of `tanks` where a tank was added, removed or changed.
+  void publish_tanks(BucketTable<TankView> &tanks)
+  {
+    static std::array<std::vector<const tank::Tank *>, BucketTable<TankView>::bucket_count> current;
+    for (auto &r: current)
+    {
+      r.clear();
+    }
+    for (auto t: g::tanks)
+    {
+      current[BucketTable<TankView>::bucket_of(t->get_id())].emplace_back(t);
+    }
+    for (std::size_t i = 0; i < current.size(); ++i)
+    {
+      auto prev = tanks.get_bucket(i);
+      if ((prev == nullptr ? 0 : prev->size()) == current[i].size()
+          && std::all_of(current[i].begin(), current[i].end(), [prev](auto &&t)
+                         {
+                           auto it = prev->find(t->get_id());
+                           return it != prev->end() && it->second == extract_tank(t);
+                         }))
+      {
+        continue;
+      }
+      BucketTable<TankView>::Bucket bucket;
+      for (auto t: current[i])
+      {
+        bucket.emplace(t->get_id(), extract_tank(t));
+      }
+      tanks.set_bucket(i, std::move(bucket));
+    }
+  }
+  
+  void publish_world()
+  {
+    // About 16 seconds of ticks.
+    constexpr std::size_t history_size = 1024;
+    
+    auto prev = get_world();
+    auto world = std::make_shared<World>();
+    world->version = prev->version + 1;
+    world->seed = g::seed;
+    world->backing = g::game_map.get_backing();
+    world->tanks = prev->tanks;
+    publish_tanks(world->tanks);
+    
+    auto changes = std::make_shared<WorldChanges>();
+    changes->version = world->version;
+    changes->prev = prev->changes;
+    changes->overflowed = !g::change_journal.read(g::world_cursor, {INT_MIN, INT_MAX, INT_MIN, INT_MAX},
+                                                  changes->zones);
+    
+    auto &map_chunks = g::game_map.get_chunks();
+    if (changes->overflowed)
+    {
+      for (auto &r: map_chunks)
+      {
+        world->chunks.set(r.first, extract_chunk(r.second));
+      }
+    }
+    else
+    {
+      world->chunks = prev->chunks;
+      std::unordered_set<std::uint64_t> dirty;
+      for (auto &z: changes->zones)
+      {
+        map::for_each_chunk(z, [&dirty](std::uint64_t key, const map::Zone &) { dirty.insert(key); });
+      }
+      for (auto &key: dirty)
+      {
+        if (auto it = map_chunks.find(key); it != map_chunks.end())
+        {
+          world->chunks.set(key, extract_chunk(it->second));
+        }
+        else
+        {
+          world->chunks.erase(key);
+        }
+      }
+    }
+    
+    g::world_history.emplace_back(changes);
+    if (g::world_history.size() > history_size)
+    {
+      g::world_history.pop_front();
+    }
+    world->changes = std::move(changes);
+    g::world.store(std::move(world));
+  }
+  
+  std::shared_ptr<const World> get_world()
   {
-    std::map<size_t, TankView> view;
-    for (auto &r: g::tanks)
-    {
-      view.insert(std::make_pair(r.second->get_id(),
-                                 TankView{
-                                     .info = r.second->get_info(),
-                                     .hp = r.second->get_hp(),
-                                     .pos = r.second->get_pos(),
-                                     .direction = r.second->get_direction(),
-                                     .is_auto = r.second->is_auto(),
-                                     .is_alive = r.second->is_alive()
-                                 }));
-    }
-    return view;
+    return g::world.load();
   }
   
   std::optional<TankView> view_id_at(size_t id)
@@ -263,13 +448,29 @@ namespace czh::drawing
   }
   
   
+  // Adds the points of the snapshot's changes in `zone`, moved by (dx, dy).
+  void add_screen_changes(std::set<map::Pos> &ret, const map::Zone &zone, int dx, int dy)
+  {
+    for (auto &z: g::snapshot.changes)
+    {
+      auto clipped = z.intersect(zone);
+      for (int i = clipped.x_min; i < clipped.x_max; ++i)
+      {
+        for (int j = clipped.y_min; j < clipped.y_max; ++j)
+        {
+          ret.insert(map::Pos{i + dx, j + dy});
+        }
+      }
+    }
+  }
+  
   std::set<map::Pos> get_screen_changes(const map::Direction &move)
   {
     std::set<map::Pos> ret;
     // When the visible zone moves, every point in the screen doesn't move, but its corresponding pos changes.
     // so we need to do something to get the correct changes:
     // 1.  if there's no difference in the two point in the moving direction, ignore.
-    // 2.  move the map's map_changes to its corresponding screen position.
+    // 2.  move the map's changes to its corresponding screen position.
     auto zone = g::visible_zone.bigger_zone(2);
     switch (move)
     {
@@ -285,13 +486,7 @@ namespace czh::drawing
             }
           }
         }
-        for (auto &p: g::snapshot.changes)
-        {
-          if (zone.contains(p))
-          {
-            ret.insert(map::Pos{p.x, p.y + 1});
-          }
-        }
+        add_screen_changes(ret, zone, 0, 1);
         break;
       case map::Direction::DOWN:
         for (int i = g::visible_zone.x_min; i < g::visible_zone.x_max; i++)
@@ -305,13 +500,7 @@ namespace czh::drawing
             }
           }
         }
-        for (auto &p: g::snapshot.changes)
-        {
-          if (zone.contains(p))
-          {
-            ret.insert(map::Pos{p.x, p.y - 1});
-          }
-        }
+        add_screen_changes(ret, zone, 0, -1);
         break;
       case map::Direction::LEFT:
         for (int i = g::visible_zone.x_min - 1; i < g::visible_zone.x_max + 1; i++)
@@ -325,13 +514,7 @@ namespace czh::drawing
             }
           }
         }
-        for (auto &p: g::snapshot.changes)
-        {
-          if (zone.contains(p))
-          {
-            ret.insert(map::Pos{p.x - 1, p.y});
-          }
-        }
+        add_screen_changes(ret, zone, -1, 0);
         break;
       case map::Direction::RIGHT:
         for (int i = g::visible_zone.x_min - 1; i < g::visible_zone.x_max + 1; i++)
@@ -345,22 +528,10 @@ namespace czh::drawing
             }
           }
         }
-        for (auto &p: g::snapshot.changes)
-        {
-          if (zone.contains(p))
-          {
-            ret.insert(map::Pos{p.x + 1, p.y});
-          }
-        }
+        add_screen_changes(ret, zone, 1, 0);
         break;
       case map::Direction::END:
-        for (auto &p: g::snapshot.changes)
-        {
-          if (zone.contains(p))
-          {
-            ret.insert(p);
-          }
-        }
+        add_screen_changes(ret, zone, 0, 0);
         break;
     }
     g::snapshot.changes.clear();
@@ -427,38 +598,38 @@ namespace czh::drawing
   
   int update_snapshot()
   {
+    profile::Timer t(profile::Phase::SNAPSHOT);
     if (g::game_mode == czh::game::GameMode::SERVER || g::game_mode == czh::game::GameMode::NATIVE)
     {
-      g::snapshot.map = extract_map(g::visible_zone.bigger_zone(10));
-      g::snapshot.tanks = extract_tanks();
-      g::snapshot.changes = g::userdata[g::user_id].map_changes;
-      g::userdata[g::user_id].map_changes.clear();
-      return 0;
-    }
-    else
-    {
-      int ret = g::online_client.update();
-      if (ret == 0)
+      auto world = get_world();
+      auto zone = g::visible_zone.bigger_zone(10);
+      std::size_t version;
       {
-        g::client_failed_attempts = 0;
-        return 0;
+        std::lock_guard<std::mutex> l(g::mainloop_mtx);
+        auto &user = g::userdata[g::user_id];
+        version = std::exchange(user.world_version, world->version);
+        user.visible_zone = zone;
       }
-      else
+      g::snapshot.map = world->extract_map(zone);
+      g::snapshot.zone = zone;
+      g::snapshot.tanks = world->get_tanks();
+      g::snapshot.changes.clear();
+      if (!world->read_changes(version, zone, g::snapshot.changes))
       {
-        g::client_failed_attempts++;
         g::output_inited = false;
-        return -1;
       }
+      return 0;
     }
-    return -1;
+    // The client's thread updates the snapshot by itself.
+    return 0;
   }
   
   void draw()
   {
     if (g::game_suspend) return;
+    profile::Timer t(profile::Phase::DRAW);
     term::hide_cursor();
-    std::lock_guard<std::mutex> l1(g::mainloop_mtx);
-    std::lock_guard<std::mutex> l2(g::drawing_mtx);
+    std::lock_guard<std::mutex> l(g::drawing_mtx);
     if (g::screen_height != term::get_height() || g::screen_width != term::get_width())
     {
       term::clear();
@@ -500,11 +671,35 @@ Command:
     - Continue.
 
   fill [Status] [A x,y] [B x,y optional]
-    - Status: [0] Empty [1] Wall
+    - Status: [0] Empty [1] Wall [2] Generated
     - Fill the area from A to B as the given Status.
     - B defaults to the same as A
     - e.g.  fill 1 0 0 10 10   |   fill 1 0 0
 
+  copy [A x,y] [B x,y]
+    - Copy the walls in the area from A to B.
+    - e.g.  copy 0 0 10 10
+
+  paste [x,y]
+    - Paste the copied area with its top-left corner at the given point.
+    - e.g.  paste 20 20
+
+  save [path]
+    - Save the world to the given file.
+    - e.g.  save world.tank
+
+  load [path]
+    - Load the world from the given file. (only Native)
+    - e.g.  load world.tank
+
+  stats
+    - Show the ticks per second, the memory used by the map, the number of tanks and bullets, and the input latency.
+
+  profile (dump [path optional])
+    - Show how long each phase of the tick, the drawing and each server request took in the last 5 seconds.
+    - dump writes it to the given file, which defaults to profile.txt.
+    - e.g.  profile   |   profile dump tick.txt
+
   tp [A id] ([B id] or [B x,y])
     - Teleport A to B
     - A should be alive, and there should be space around B.
@@ -548,6 +743,10 @@ Command:
       - tick (int, milliseconds): minimum time of the game's(or server's) mainloop.
   set msg_ttl [ttl]
       - ttl (int, milliseconds): a message's time to live.
+  set chunk_ttl [ttl]
+      - ttl (int, minutes): how long a changed chunk stays in memory after nobody sees it.
+  set path_budget [budget]
+      - budget (int, 882 to 1048576): points the auto tanks' searches may visit in a tick.
   set seed [seed]
       - seed (unsigned long long): the game map's seed.
   
@@ -632,6 +831,9 @@ Command:
     {
       case game::Page::GAME:
       {
+        // the focused tank may not be published yet
+        if (!view_id_at(g::tank_focus).has_value()) return;
+        
         // check zone
         if (!check_zone_size(g::visible_zone))
         {
@@ -658,6 +860,9 @@ Command:
           }
         }
         
+        // a client's snapshot lags behind after the zone jumps
+        if (g::snapshot.zone.intersect(g::visible_zone) != g::visible_zone) return;
+        
         // output
         if (!g::output_inited)
         {
@@ -902,6 +1107,36 @@ Command:
         }
       }
         break;
+      case game::Page::PROFILE:
+      {
+        if (!g::output_inited)
+        {
+          term::clear();
+          g::output_inited = true;
+        }
+        term::mvoutput({g::screen_width / 2 - 3, 0}, "Profile");
+        auto us = [](std::chrono::nanoseconds d) { return static_cast<double>(d.count()) / 1000; };
+        term::move_cursor({0, 1});
+        term::output(std::left, std::setw(14), "Phase", "  ",
+                     std::right, std::setw(8), "Count", "  ",
+                     std::setw(10), "p50(us)", "  ",
+                     std::setw(10), "p99(us)", "  ",
+                     std::setw(10), "Max(us)", std::left);
+        for (std::size_t i = 0; i < profile::phase_count && i + 3 < g::screen_height; ++i)
+        {
+          auto phase = static_cast<profile::Phase>(i);
+          auto stats = profile::get_stats(phase);
+          term::move_cursor({0, i + 2});
+          term::output(std::left, std::setw(14), profile::get_name(phase), "  ",
+                       std::right, std::setw(8), stats.count, "  ", std::fixed, std::setprecision(1),
+                       std::setw(10), us(stats.p50), "  ",
+                       std::setw(10), us(stats.p99), "  ",
+                       std::setw(10), us(stats.max), std::left, std::defaultfloat);
+        }
+        term::mvoutput({g::screen_width / 2 - 12, g::screen_height - 2}, "In the last ",
+                       profile::Histogram::window_count, " seconds");
+      }
+        break;
     }
     // command
     if (g::typing_command)
@@ -916,11 +1151,18 @@ Command:
       auto d2 = std::chrono::duration_cast<std::chrono::milliseconds>(now - g::last_message_displayed);
       if (d2 > g::msg_ttl)
       {
-        if (!g::userdata[g::user_id].messages.empty())
+        std::optional<msg::Message> msg;
+        {
+          std::lock_guard<std::mutex> ml(g::mainloop_mtx);
+          if (!g::userdata[g::user_id].messages.empty())
+          {
+            msg = g::userdata[g::user_id].messages.top();
+            g::userdata[g::user_id].messages.pop();
+          }
+        }
+        if (msg.has_value())
         {
-          auto msg = g::userdata[g::user_id].messages.top();
-          g::userdata[g::user_id].messages.pop();
-          std::string str = ((msg.from == -1) ? "" : std::to_string(msg.from) + ": ") + msg.content;
+          std::string str = ((msg->from == -1) ? "" : std::to_string(msg->from) + ": ") + msg->content;
           int a2 = static_cast<int>(g::screen_width) - static_cast<int>(utils::escape_code_len(str));
           if (a2 > 0)
           {
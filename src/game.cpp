@@ -17,11 +17,20 @@
 #include "tank/utils.h"
 #include "tank/tank.h"
 #include "tank/bullet.h"
+#include "tank/drawing.h"
 #include "tank/globals.h"
+#include "tank/archive.h"
+#include "tank/profile.h"
+#include "tank/replay.h"
 #include <optional>
 #include <mutex>
 #include <vector>
 #include <list>
+#include <filesystem>
+#include <algorithm>
+#include <latch>
+#include <thread>
+#include <tuple>
 
 namespace czh::g
 {
@@ -32,18 +41,34 @@ namespace czh::g
   std::map<size_t, UserData> userdata{{0, UserData{.user_id = 0}}};
   std::chrono::milliseconds tick(16);
   std::chrono::milliseconds msg_ttl(2000);
+  std::chrono::minutes chunk_ttl(10);
+  int tps = 0;
+  std::chrono::steady_clock::time_point last_compaction = std::chrono::steady_clock::now();
   std::mutex mainloop_mtx;
-  std::mutex tank_reacting_mtx;
-  std::map<std::size_t, tank::Tank *> tanks;
-  std::list<bullet::Bullet *> bullets;
-  std::vector<std::pair<std::size_t, tank::NormalTankEvent>> normal_tank_events;
+  tank::TankRegistry tanks;
+  tank::TankIndex tank_index;
+  bullet::BulletPool bullets;
+  game::InputQueue input_queue(1024);
+  game::InputStats input_stats;
+  online::Thpool ai_pool(std::thread::hardware_concurrency());
   size_t next_id = 0;
+  std::atomic<std::size_t> tick_count = 0;
 }
 
 namespace czh::game
 {
-  std::optional<map::Pos> get_available_pos()
+  std::optional<map::Pos> find_available_pos()
   {
+    // Try some random points first, which is as uniform as picking from all the available ones.
+    for (int i = 0; i < 64; ++i)
+    {
+      map::Pos pos(utils::randnum<int>(g::visible_zone.x_min, g::visible_zone.x_max),
+                   utils::randnum<int>(g::visible_zone.y_min, g::visible_zone.y_max));
+      if (!g::game_map.has(map::Status::WALL, pos) && !g::game_map.has(map::Status::TANK, pos))
+      {
+        return pos;
+      }
+    }
     std::vector<map::Pos> p;
     for (int i = g::visible_zone.x_min; i < g::visible_zone.x_max; ++i)
     {
@@ -62,28 +87,41 @@ namespace czh::game
     return p[utils::randnum<size_t>(0, p.size())];
   }
   
+  std::optional<map::Pos> get_available_pos()
+  {
+    // The positions of a replay are recorded, since they depend on the screen.
+    if (g::replayer.is_replaying())
+    {
+      return g::replayer.next_pos();
+    }
+    auto ret = find_available_pos();
+    if (ret.has_value())
+    {
+      g::recorder.pos(*ret);
+    }
+    return ret;
+  }
+  
   tank::Tank *id_at(size_t id)
   {
-    auto it = g::tanks.find(id);
-    if (it == g::tanks.end()) return nullptr;
-    return it->second;
+    return g::tanks.at(id);
   }
   
   std::size_t add_tank(const map::Pos &pos)
   {
-    g::tanks.insert({g::next_id, new tank::NormalTank
-        (info::TankInfo{
-            .max_hp = 10000,
-            .name = "Tank " + std::to_string(g::next_id),
-            .id = g::next_id,
-            .type = info::TankType::NORMAL,
-            .bullet = info::BulletInfo
-                {
-                    .hp = 1,
-                    .lethality = 100,
-                    .range = 30,
-                }
-        }, pos)});
+    g::tanks.add_normal(info::TankInfo{
+        .max_hp = 10000,
+        .name = "Tank " + std::to_string(g::next_id),
+        .id = g::next_id,
+        .type = info::TankType::NORMAL,
+        .bullet = info::BulletInfo
+            {
+                .hp = 1,
+                .lethality = 100,
+                .range = 30,
+            }
+    }, pos);
+    g::recorder.add_tank(g::next_id, pos);
     ++g::next_id;
     return g::next_id - 1;
   }
@@ -95,22 +133,29 @@ namespace czh::game
     return add_tank(*pos);
   }
   
+  void remove_tank(std::size_t id)
+  {
+    g::tanks.at(id)->kill();
+    g::tanks.at(id)->clear();
+    g::tanks.remove(id);
+    g::recorder.remove_tank(id);
+  }
+  
   std::size_t add_auto_tank(std::size_t lvl, const map::Pos &pos)
   {
-    g::tanks.insert({g::next_id,
-                     new tank::AutoTank(
-                         info::TankInfo{
-                             .max_hp = static_cast<int>(11 - lvl) * 150,
-                             .name = "AutoTank " + std::to_string(g::next_id),
-                             .id = g::next_id,
-                             .gap = static_cast<int>(10 - lvl),
-                             .type = info::TankType::AUTO,
-                             .bullet = info::BulletInfo
-                                 {
-                                     .hp = 1,
-                                     .lethality = static_cast<int>(11 - lvl) * 15,
-                                     .range = 30
-                                 }}, pos)});
+    g::tanks.add_auto(info::TankInfo{
+        .max_hp = static_cast<int>(11 - lvl) * 150,
+        .name = "AutoTank " + std::to_string(g::next_id),
+        .id = g::next_id,
+        .gap = static_cast<int>(10 - lvl),
+        .type = info::TankType::AUTO,
+        .bullet = info::BulletInfo
+            {
+                .hp = 1,
+                .lethality = static_cast<int>(11 - lvl) * 15,
+                .range = 30
+            }}, pos);
+    g::recorder.add_auto_tank(g::next_id, lvl, pos);
     ++g::next_id;
     return g::next_id - 1;
   }
@@ -144,11 +189,11 @@ namespace czh::game
   [[nodiscard]]std::vector<std::size_t> get_alive()
   {
     std::vector<std::size_t> ret;
-    for (std::size_t i = 0; i < g::tanks.size(); ++i)
+    for (auto t: g::tanks)
     {
-      if (g::tanks[i]->is_alive())
+      if (t->is_alive())
       {
-        ret.emplace_back(i);
+        ret.emplace_back(t->get_id());
       }
     }
     return ret;
@@ -156,144 +201,443 @@ namespace czh::game
   
   void clear_death()
   {
-    for (auto it = g::bullets.begin(); it != g::bullets.end();)
+    g::bullets.clear_death();
+    
+    for (auto tank: g::tanks)
     {
-      if (!(*it)->is_alive())
+      if (!tank->is_alive() && !tank->has_cleared())
       {
-        g::game_map.remove_status(map::Status::BULLET, (*it)->get_pos());
-        delete *it;
-        it = g::bullets.erase(it);
-      }
-      else
-      {
-        ++it;
+        tank->clear();
       }
     }
-    
-    for (auto it = g::tanks.begin(); it != g::tanks.end(); ++it)
+  }
+  
+  InputQueue::InputQueue(std::size_t capacity)
+      : slots(std::make_unique<Slot[]>(capacity)), mask(capacity - 1), tail(0), head(0), dropped(0)
+  {
+    utils::tank_assert((capacity & mask) == 0, "The capacity must be a power of 2.");
+    for (std::size_t i = 0; i < capacity; ++i)
+    {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  
+  bool InputQueue::push(const InputEvent &event)
+  {
+    auto pos = tail.load(std::memory_order_relaxed);
+    while (true)
     {
-      auto tank = *it;
-      if (!tank.second->is_alive() && !tank.second->has_cleared())
+      auto &slot = slots[pos & mask];
+      auto seq = slot.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0)
       {
-        tank.second->clear();
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          slot.event = event;
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+      {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      else
+      {
+        pos = tail.load(std::memory_order_relaxed);
       }
     }
   }
   
+  bool InputQueue::pop(InputEvent &event)
+  {
+    auto &slot = slots[head & mask];
+    if (slot.seq.load(std::memory_order_acquire) != head + 1) return false;
+    event = slot.event;
+    slot.seq.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return true;
+  }
+  
+  void InputQueue::clear()
+  {
+    InputEvent event{};
+    while (pop(event));
+  }
+  
+  std::size_t InputQueue::get_dropped() const
+  {
+    return dropped.load(std::memory_order_relaxed);
+  }
+  
   void tank_react(std::size_t id, tank::NormalTankEvent event)
   {
     if (!g::game_running) return;
-    
-    std::lock_guard<std::mutex> l(g::tank_reacting_mtx);
-    if (id_at(id)->is_alive())
+    // Tanks are added and removed under mainloop_mtx, so whether the tank is alive is left to
+    // apply_input on the tick.
+    g::input_queue.push({.tank_id = id, .event = event, .tick = g::tick_count,
+                         .received = std::chrono::steady_clock::now()});
+  }
+  
+  // Keeps the memory of a long-running game bounded: drops the points left empty, and moves the
+  // chunks that nobody has seen for chunk_ttl to the spill file, which is written in the background.
+  void compact_map()
+  {
+    archive::finish_spill();
+    constexpr auto interval = std::chrono::seconds(30);
+    auto now = std::chrono::steady_clock::now();
+    if (now - g::last_compaction < interval) return;
+    g::last_compaction = now;
+    for (auto &r: g::userdata)
     {
-      g::normal_tank_events.emplace_back(std::make_pair(id, event));
+      g::game_map.see(r.second.visible_zone, now);
+    }
+    g::game_map.compact();
+    if (auto cold = g::game_map.get_cold_chunks(now - g::chunk_ttl); !cold.empty())
+    {
+      archive::spill(cold, now - g::chunk_ttl);
     }
   }
   
-  void mainloop()
+  // Measures how many ticks actually run in a second.
+  void count_tick()
   {
-    if (!g::game_running) return;
+    static auto beg = std::chrono::steady_clock::now();
+    static int ticks = 0;
+    ++ticks;
+    auto now = std::chrono::steady_clock::now();
+    auto d = std::chrono::duration_cast<std::chrono::milliseconds>(now - beg);
+    if (d >= std::chrono::seconds(1))
+    {
+      g::tps = static_cast<int>(ticks * 1000 / d.count());
+      beg = now;
+      ticks = 0;
+    }
+  }
+  
+  void apply_input(const InputEvent &input)
+  {
+    auto tank = id_at(input.tank_id);
+    if (tank == nullptr || !tank->is_alive()) return;
+    switch (input.event)
+    {
+      case tank::NormalTankEvent::UP:
+        tank->up();
+        break;
+      case tank::NormalTankEvent::DOWN:
+        tank->down();
+        break;
+      case tank::NormalTankEvent::LEFT:
+        tank->left();
+        break;
+      case tank::NormalTankEvent::RIGHT:
+        tank->right();
+        break;
+      case tank::NormalTankEvent::FIRE:
+        tank->fire();
+        break;
+    }
+  }
+  
+  // Applies the inputs received since the last tick. A tank moves at most once and fires at most
+  // once in a tick: the last move and the first fire are kept, in the order of their tick stamps
+  // and then the order they were queued.
+  void apply_inputs()
+  {
+    struct Queued
+    {
+      InputEvent event;
+      std::size_t seq;
+      
+      bool operator<(const Queued &q) const
+      {
+        return std::tie(event.tick, seq) < std::tie(q.event.tick, q.seq);
+      }
+    };
+    struct Pending
+    {
+      std::size_t tank_id;
+      std::optional<Queued> move;
+      std::optional<Queued> fire;
+    };
+    static std::vector<Pending> pending;
+    static auto beg = std::chrono::steady_clock::now();
+    static InputStats stats;
+    static std::chrono::microseconds total_latency{0};
     
-    std::lock_guard<std::mutex> l(g::mainloop_mtx);
-    //normal tank
-    for (auto &r: g::normal_tank_events)
+    pending.clear();
+    InputEvent input{};
+    for (std::size_t seq = 0; g::input_queue.pop(input); ++seq)
     {
-      auto tank = id_at(r.first);
-      switch (r.second)
+      auto it = std::find_if(pending.begin(), pending.end(),
+                             [&input](auto &&p) { return p.tank_id == input.tank_id; });
+      if (it == pending.end())
       {
-        case tank::NormalTankEvent::UP:
-          tank->up();
-          break;
-        case tank::NormalTankEvent::DOWN:
-          tank->down();
-          break;
-        case tank::NormalTankEvent::LEFT:
-          tank->left();
-          break;
-        case tank::NormalTankEvent::RIGHT:
-          tank->right();
-          break;
-        case tank::NormalTankEvent::FIRE:
-          tank->fire();
-          break;
+        it = pending.insert(pending.end(), Pending{.tank_id = input.tank_id, .move = std::nullopt, .fire = std::nullopt});
+      }
+      if (input.event == tank::NormalTankEvent::FIRE)
+      {
+        if (it->fire.has_value())
+        {
+          ++stats.coalesced;
+          continue;
+        }
+        it->fire = Queued{input, seq};
+      }
+      else
+      {
+        if (it->move.has_value()) ++stats.coalesced;
+        it->move = Queued{input, seq};
       }
     }
-    g::normal_tank_events.clear();
     
-    //auto tank
-    for (auto it = g::tanks.begin(); it != g::tanks.end(); ++it)
+    auto now = std::chrono::steady_clock::now();
+    auto apply = [&now](const InputEvent &e)
+    {
+      g::recorder.input(e.tank_id, e.event);
+      apply_input(e);
+      auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - e.received);
+      ++stats.applied;
+      total_latency += latency;
+      stats.max_latency = std::max(stats.max_latency, latency);
+    };
+    for (auto &p: pending)
     {
-      utils::tank_assert(it->second != nullptr);
-      if (it->second->is_alive() && it->second->is_auto())
+      if (p.move && p.fire && *p.fire < *p.move)
+      {
+        apply(p.fire->event);
+        apply(p.move->event);
+      }
+      else
       {
-        dynamic_cast<tank::AutoTank *>(it->second)->react();
+        if (p.move) apply(p.move->event);
+        if (p.fire) apply(p.fire->event);
       }
     }
-    // bullet move
-    for (auto it = g::bullets.begin(); it != g::bullets.end(); ++it)
+    
+    if (now - beg >= std::chrono::seconds(1))
     {
-      if ((*it)->is_alive())
+      if (stats.applied != 0)
       {
-        (*it)->react();
+        stats.avg_latency = total_latency / stats.applied;
       }
+      g::input_stats = stats;
+      stats = InputStats{};
+      total_latency = std::chrono::microseconds{0};
+      beg = now;
     }
-    
-    for (auto it = g::bullets.begin(); it != g::bullets.end(); ++it)
+  }
+  
+  // Kills all the bullets in every point with more than one bullet or a tank, and the tank is
+  // attacked by their total lethality. Each point is resolved once, in the order of its first
+  // alive bullet.
+  void resolve_collisions()
+  {
+    auto &collisions = g::bullets.get_collisions();
+    for (std::size_t i = 0; i < g::bullets.size(); ++i)
     {
-      if (!(*it)->is_alive()) continue;
+      if (!g::bullets.is_alive(i)) continue;
+      auto &cell = collisions.cell_of(i);
+      if (cell.resolved) continue;
+      cell.resolved = true;
+      
+      auto &point = g::game_map.at(cell.pos);
+      if (cell.count == 1 && !point.has(map::Status::TANK)) continue;
       
-      if ((g::game_map.count(map::Status::BULLET, (*it)->get_pos()) > 1)
-          || g::game_map.has(map::Status::TANK, (*it)->get_pos()))
+      for (auto j = cell.first; j != bullet::CollisionTable::end; j = collisions.next_in_cell(j))
       {
-        int lethality = 0;
-        int attacker = -1;
-        auto bullets_instance = g::game_map.at((*it)->get_pos()).get_bullets();
-        utils::tank_assert(!bullets_instance.empty());
-        for (auto it1 = bullets_instance.begin(); it1 != bullets_instance.end(); ++it1)
-        {
-          if ((*it1)->is_alive())
-          {
-            lethality += (*it1)->get_lethality();
-          }
-          (*it1)->kill();
-          attacker = (*it1)->get_tank();
-        }
-        
-        if (g::game_map.has(map::Status::TANK, (*it)->get_pos()))
+        g::bullets.kill(j);
+      }
+      // The attacker is the one who fired the bullet that entered the point last.
+      int attacker = g::bullets.get_tank(g::bullets.index_of(point.get_bullets().back()));
+      
+      if (point.has(map::Status::TANK))
+      {
+        if (auto tank = point.get_tank(); tank != nullptr)
         {
-          if (auto tank = g::game_map.at((*it)->get_pos()).get_tank(); tank != nullptr)
+          auto tank_attacker = id_at(attacker);
+          utils::tank_assert(tank_attacker != nullptr);
+          if (tank->is_auto())
           {
-            auto tank_attacker = id_at(attacker);
-            utils::tank_assert(tank_attacker != nullptr);
-            if (tank->is_auto())
-            {
-              auto t = dynamic_cast<tank::AutoTank *>(tank);
-              if (attacker != t->get_id()
-                  && map::get_distance(tank_attacker->get_pos(), tank->get_pos()) < 30)
-              {
-                t->target(attacker, tank_attacker->get_pos());
-              }
-            }
-            tank->attacked(lethality);
-            if (!tank->is_alive())
+            auto t = static_cast<tank::AutoTank *>(tank);
+            if (attacker != t->get_id()
+                && map::get_distance(tank_attacker->get_pos(), tank->get_pos()) < 30)
             {
-              msg::info(-1, tank->get_name() + " was killed by " + tank_attacker->get_name());
+              t->target(attacker, tank_attacker->get_pos());
             }
           }
+          tank->attacked(cell.lethality);
+          if (!tank->is_alive())
+          {
+            msg::info(-1, tank->get_name() + " was killed by " + tank_attacker->get_name());
+          }
         }
       }
     }
-    clear_death();
   }
   
-  void quit()
+  // All the auto tanks plan against the same world in parallel, then their intents are applied
+  // in the order of their ids, so the result doesn't depend on the number of threads.
+  void react_auto_tanks()
   {
-    for (auto it = g::tanks.begin(); it != g::tanks.end();)
+    static std::vector<tank::AutoTank *> autos;
+    static std::vector<tank::AutoTankIntent> intents;
+    autos.clear();
+    g::tanks.for_each_alive<tank::AutoTank>([](tank::AutoTank &t) { autos.emplace_back(&t); });
+    std::sort(autos.begin(), autos.end(), [](auto &&a, auto &&b) { return a->get_id() < b->get_id(); });
+    intents.resize(autos.size());
+    
+    constexpr std::size_t batch_size = 16;
+    auto batches = (autos.size() + batch_size - 1) / batch_size;
+    auto plan = [](std::size_t batch)
+    {
+      for (auto i = batch * batch_size; i < std::min(autos.size(), (batch + 1) * batch_size); ++i)
+      {
+        intents[i] = autos[i]->plan();
+      }
+    };
+    if (batches <= 1 || std::thread::hardware_concurrency() <= 1)
+    {
+      for (std::size_t b = 0; b < batches; ++b) plan(b);
+    }
+    else
+    {
+      std::latch done(static_cast<std::ptrdiff_t>(batches));
+      std::exception_ptr err = nullptr;
+      std::mutex err_mtx;
+      for (std::size_t b = 0; b < batches; ++b)
+      {
+        g::ai_pool.add_task([&, b]
+                            {
+                              try
+                              {
+                                plan(b);
+                              }
+                              catch (...)
+                              {
+                                std::lock_guard<std::mutex> l(err_mtx);
+                                err = std::current_exception();
+                              }
+                              done.count_down();
+                            });
+      }
+      done.wait();
+      if (err != nullptr) std::rethrow_exception(err);
+    }
+    
+    for (std::size_t i = 0; i < autos.size(); ++i)
+    {
+      autos[i]->apply(intents[i]);
+    }
+  }
+  
+  void mainloop()
+  {
+    std::lock_guard<std::mutex> l(g::mainloop_mtx);
+    count_tick();
+    compact_map();
+    if (!g::game_running)
+    {
+      // Commands can still change the world while paused.
+      drawing::publish_world();
+      return;
+    }
+    profile::Timer tick_timer(profile::Phase::TICK);
+    
+    //normal tank
     {
-      delete it->second;
-      it = g::tanks.erase(it);
+      profile::Timer t(profile::Phase::INPUT);
+      apply_inputs();
     }
+    
+    //auto tank
+    {
+      profile::Timer t(profile::Phase::PATH);
+      // The flow fields take at most half of the budget, and the queued searches the rest.
+      auto field_budget = g::path_budget / 2;
+      g::flow_fields.update(field_budget);
+      auto budget = g::path_budget - g::path_budget / 2 + field_budget;
+      g::path_jobs.run(budget);
+    }
+    {
+      profile::Timer t(profile::Phase::AI);
+      react_auto_tanks();
+    }
+    // bullet move
+    {
+      profile::Timer t(profile::Phase::BULLET);
+      g::bullets.react();
+    }
+    {
+      profile::Timer t(profile::Phase::COLLISION);
+      resolve_collisions();
+    }
+    {
+      profile::Timer t(profile::Phase::CLEAR_DEATH);
+      clear_death();
+    }
+    ++g::tick_count;
+    drawing::publish_world();
+  }
+  
+  void run_mainloop()
+  {
+    // Ticks that are late run back to back to catch up, but no more than max_catch_up at once,
+    // so a stall doesn't turn into a burst of ticks.
+    constexpr int max_catch_up = 5;
+    auto next_tick = std::chrono::steady_clock::now();
+    while (true)
+    {
+      auto now = std::chrono::steady_clock::now();
+      if (g::game_mode == game::GameMode::CLIENT)
+      {
+        next_tick = now + g::tick;
+      }
+      for (int i = 0; i < max_catch_up && next_tick <= now; ++i)
+      {
+        mainloop();
+        if (g::game_mode == game::GameMode::SERVER)
+        {
+          remove_disconnected();
+        }
+        next_tick += g::tick;
+      }
+      if (next_tick <= now)
+      {
+        next_tick = now + g::tick;
+      }
+      std::this_thread::sleep_until(next_tick);
+    }
+  }
+  
+  void remove_disconnected()
+  {
+    std::lock_guard<std::mutex> l(g::mainloop_mtx);
+    std::vector<size_t> disconnected;
+    for (auto &r: g::userdata)
+    {
+      if (r.first == 0) continue;
+      auto d = std::chrono::duration_cast<std::chrono::seconds>
+          (std::chrono::steady_clock::now() - r.second.last_update);
+      if (d.count() > 5)
+      {
+        disconnected.emplace_back(r.first);
+      }
+    }
+    for (auto &r: disconnected)
+    {
+      msg::info(-1, g::userdata[r].ip + " (" + std::to_string(r) + ") disconnected.");
+      remove_tank(r);
+      g::userdata.erase(r);
+    }
+  }
+  
+  void quit()
+  {
+    g::recorder.stop();
+    g::tanks.clear();
     if (g::game_mode == game::GameMode::CLIENT)
     {
       g::online_client.disconnect();
@@ -302,5 +646,11 @@ namespace czh::game
     {
       g::online_server.stop();
     }
+    if (!g::spill_path.empty())
+    {
+      archive::finish_spill(true);
+      std::error_code ec;
+      std::filesystem::remove(g::spill_path, ec);
+    }
   }
 }
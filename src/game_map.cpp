@@ -15,11 +15,17 @@
 #include "tank/game_map.h"
 #include "tank/globals.h"
 #include "tank/utils.h"
+#include "tank/archive.h"
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <tuple>
+#include <bit>
 
 namespace czh::g
 {
   map::Map game_map;
+  map::ChangeJournal change_journal(1 << 17);
   unsigned long long seed = utils::randnum<unsigned long long>(1, 20);
   map::Point empty_point("used for empty point", {});
   map::Point wall_point("used for wall point", {map::Status::WALL});
@@ -29,10 +35,47 @@ namespace czh::map
 {
   void add_changes(const Pos &p)
   {
-    for (auto &r: g::userdata)
+    g::change_journal.add({p.x, p.x + 1, p.y, p.y + 1});
+  }
+  
+  ChangeJournal::ChangeJournal(std::size_t capacity) : ring(capacity), head(0), oldest(0) {}
+  
+  void ChangeJournal::add(const Zone &zone)
+  {
+    ring[head % ring.size()] = {.tick = g::tick_count, .zone = zone};
+    ++head;
+  }
+  
+  std::size_t ChangeJournal::end() const
+  {
+    return head;
+  }
+  
+  void ChangeJournal::reset()
+  {
+    // Skips one change, so that readers which have read everything fail too.
+    oldest = ++head;
+  }
+  
+  bool ChangeJournal::read(std::size_t &cursor, const Zone &zone, std::vector<Zone> &changes) const
+  {
+    if (cursor > head || cursor < oldest || head - cursor > ring.size())
+    {
+      cursor = head;
+      return false;
+    }
+    auto beg = changes.size();
+    for (; cursor < head; ++cursor)
     {
-      r.second.map_changes.insert(p);
+      auto clipped = ring[cursor % ring.size()].zone.intersect(zone);
+      if (!clipped.is_empty())
+      {
+        changes.emplace_back(clipped);
+      }
     }
+    std::sort(changes.begin() + beg, changes.end());
+    changes.erase(std::unique(changes.begin() + beg, changes.end()), changes.end());
+    return true;
   }
   
   Zone Zone::bigger_zone(int i) const
@@ -53,19 +96,48 @@ namespace czh::map
     return contains(p.x, p.y);
   }
   
+  bool Zone::is_empty() const
+  {
+    return x_min >= x_max || y_min >= y_max;
+  }
+  
+  Zone Zone::intersect(const Zone &z) const
+  {
+    return {(std::max)(x_min, z.x_min), (std::min)(x_max, z.x_max),
+            (std::max)(y_min, z.y_min), (std::min)(y_max, z.y_max)};
+  }
+  
+  bool Zone::operator==(const Zone &z) const
+  {
+    return std::tie(x_min, x_max, y_min, y_max) == std::tie(z.x_min, z.x_max, z.y_min, z.y_max);
+  }
+  
+  bool operator<(const Zone &z1, const Zone &z2)
+  {
+    return std::tie(z1.x_min, z1.x_max, z1.y_min, z1.y_max) < std::tie(z2.x_min, z2.x_max, z2.y_min, z2.y_max);
+  }
+  
+  Point::Point(const std::string &, const std::vector<Status> &s) : flags(GENERATED | TEMPORARY), tank(nullptr)
+  {
+    for (auto &r: s)
+    {
+      add_status(r, nullptr);
+    }
+  }
+  
   bool Point::is_generated() const
   {
-    return generated;
+    return flags & GENERATED;
   }
   
   bool Point::is_temporary() const
   {
-    return temporary;
+    return flags & TEMPORARY;
   }
   
   bool Point::is_empty() const
   {
-    return statuses.empty();
+    return !(flags & (WALL | TANK)) && bullets.empty();
   }
   
   tank::Tank *Point::get_tank() const
@@ -74,7 +146,7 @@ namespace czh::map
     return tank;
   }
   
-  const std::vector<bullet::Bullet *> &Point::get_bullets() const
+  const BulletList &Point::get_bullets() const
   {
     utils::tank_assert(has(Status::BULLET));
     return bullets;
@@ -82,32 +154,38 @@ namespace czh::map
   
   void Point::add_status(const Status &status, void *ptr)
   {
-    statuses.emplace_back(status);
-    if (ptr != nullptr)
+    switch (status)
     {
-      switch (status)
-      {
-        case Status::BULLET:
-          bullets.emplace_back(static_cast<bullet::Bullet *>(ptr));
-          break;
-        case Status::TANK:
+      case Status::WALL:
+        flags |= WALL;
+        break;
+      case Status::TANK:
+        flags |= TANK;
+        if (ptr != nullptr)
+        {
           tank = static_cast<tank::Tank *>(ptr);
-          break;
-        default:
-          break;
-      }
+        }
+        break;
+      case Status::BULLET:
+        utils::tank_assert(false, "Bullets are added by Map::add_bullet.");
+        break;
+      default:
+        break;
     }
   }
   
   void Point::remove_status(const Status &status)
   {
-    statuses.erase(std::remove(statuses.begin(), statuses.end(), status), statuses.end());
     switch (status)
     {
+      case Status::WALL:
+        flags &= ~WALL;
+        break;
       case Status::BULLET:
         bullets.clear();
         break;
       case Status::TANK:
+        flags &= ~TANK;
         tank = nullptr;
         break;
       default:
@@ -117,19 +195,34 @@ namespace czh::map
   
   void Point::remove_all_statuses()
   {
-    statuses.clear();
+    flags &= ~(WALL | TANK);
     bullets.clear();
     tank = nullptr;
   }
   
   [[nodiscard]] bool Point::has(const Status &status) const
   {
-    return (std::find(statuses.cbegin(), statuses.cend(), status) != statuses.cend());
+    switch (status)
+    {
+      case Status::WALL:
+        return flags & WALL;
+      case Status::TANK:
+        return flags & TANK;
+      case Status::BULLET:
+        return !bullets.empty();
+      default:
+        break;
+    }
+    return false;
   }
   
   [[nodiscard]]std::size_t Point::count(const Status &status) const
   {
-    return std::count(statuses.cbegin(), statuses.cend(), status);
+    if (status == Status::BULLET)
+    {
+      return bullets.size();
+    }
+    return has(status) ? 1 : 0;
   }
   
   bool Pos::operator==(const Pos &pos) const
@@ -156,7 +249,233 @@ namespace czh::map
     return std::abs(int(from.x - to.x)) + std::abs(int(from.y - to.y));
   }
   
-  Map::Map() = default;
+  std::uint64_t chunk_key(int chunk_x, int chunk_y)
+  {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(chunk_x)) << 32)
+           | static_cast<std::uint32_t>(chunk_y);
+  }
+  
+  std::uint64_t chunk_key(const Pos &pos)
+  {
+    return chunk_key(pos.x >> chunk_shift, pos.y >> chunk_shift);
+  }
+  
+  std::size_t chunk_index(const Pos &pos)
+  {
+    return ((pos.y & (chunk_size - 1)) << chunk_shift) | (pos.x & (chunk_size - 1));
+  }
+  
+  Zone chunk_zone(std::uint64_t key)
+  {
+    auto chunk_x = static_cast<std::int32_t>(key >> 32);
+    auto chunk_y = static_cast<std::int32_t>(key & 0xffffffff);
+    return {chunk_x * chunk_size, (chunk_x + 1) * chunk_size, chunk_y * chunk_size, (chunk_y + 1) * chunk_size};
+  }
+  
+  Map::Map() : epoch(0), next_version(0), compacted_points(0), spilled_chunks(0) {}
+  
+  bool Map::is_stored(std::uint64_t key) const
+  {
+    return backing != nullptr && backing->find(key) != nullptr;
+  }
+  
+  Chunk &Map::load_chunk(std::uint64_t key)
+  {
+    if (auto it = chunks.find(key); it != chunks.end())
+    {
+      return it->second;
+    }
+    
+    auto chunk_x = static_cast<std::int32_t>(key >> 32);
+    auto chunk_y = static_cast<std::int32_t>(key & 0xffffffff);
+    std::array<std::uint32_t, chunk_size> rows;
+    std::array<std::uint32_t, chunk_size> cols;
+    for (int i = 0; i < chunk_size; ++i)
+    {
+      rows[i] = blocked_row(chunk_x, chunk_y, i);
+      cols[i] = blocked_col(chunk_x, chunk_y, i);
+    }
+    auto &chunk = chunks[key];
+    chunk.blocked_rows = rows;
+    chunk.blocked_cols = cols;
+    chunk.last_seen = std::chrono::steady_clock::now();
+    
+    auto payload = backing == nullptr ? nullptr : backing->find(key);
+    if (payload == nullptr) return chunk;
+    Point wall;
+    wall.add_status(Status::WALL, nullptr);
+    wall.flags &= ~Point::TEMPORARY;
+    Point empty;
+    empty.flags &= ~Point::TEMPORARY;
+    for (std::size_t i = 0; i < chunk.points.size(); ++i)
+    {
+      if (archive::test_bit(payload, i))
+      {
+        chunk.points[i] = archive::test_bit(payload + archive::chunk_bitmap_size, i) ? wall : empty;
+        chunk.used.set(i);
+        ++chunk.used_count;
+      }
+    }
+    return chunk;
+  }
+  
+  void Map::refresh(Chunk &chunk, const Pos &pos)
+  {
+    auto index = chunk_index(pos);
+    auto x = pos.x & (chunk_size - 1);
+    auto y = pos.y & (chunk_size - 1);
+    bool blocked;
+    if (chunk.used[index])
+    {
+      blocked = chunk.points[index].flags & (Point::WALL | Point::TANK);
+    }
+    else
+    {
+      blocked = generate(pos, g::seed).has(Status::WALL);
+    }
+    if (blocked != static_cast<bool>(chunk.blocked_rows[y] >> x & 1))
+    {
+      versions[chunk_key(pos)] = ++next_version;
+    }
+    if (blocked)
+    {
+      chunk.blocked_rows[y] |= std::uint32_t(1) << x;
+      chunk.blocked_cols[x] |= std::uint32_t(1) << y;
+    }
+    else
+    {
+      chunk.blocked_rows[y] &= ~(std::uint32_t(1) << x);
+      chunk.blocked_cols[x] &= ~(std::uint32_t(1) << y);
+    }
+  }
+  
+  void Map::refresh(const Pos &pos)
+  {
+    if (auto it = chunks.find(chunk_key(pos)); it != chunks.end())
+    {
+      refresh(it->second, pos);
+    }
+  }
+  
+  std::uint32_t read_u32(const unsigned char *p)
+  {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+  }
+  
+  std::uint32_t Map::blocked_row(int chunk_x, int chunk_y, int y) const
+  {
+    auto key = chunk_key(chunk_x, chunk_y);
+    if (auto it = chunks.find(key); it != chunks.end())
+    {
+      return it->second.blocked_rows[y];
+    }
+    auto generated = generate_chunk(chunk_x, chunk_y, g::seed).rows[y];
+    if (backing != nullptr)
+    {
+      // A row of a bitmap is 4 bytes.
+      if (auto payload = backing->find(key); payload != nullptr)
+      {
+        auto used = read_u32(payload + y * 4);
+        auto walls = read_u32(payload + archive::chunk_bitmap_size + y * 4);
+        return (generated & ~used) | walls;
+      }
+    }
+    return generated;
+  }
+  
+  std::uint32_t Map::blocked_col(int chunk_x, int chunk_y, int x) const
+  {
+    auto key = chunk_key(chunk_x, chunk_y);
+    if (auto it = chunks.find(key); it != chunks.end())
+    {
+      return it->second.blocked_cols[x];
+    }
+    auto generated = generate_chunk(chunk_x, chunk_y, g::seed).cols[x];
+    if (backing != nullptr)
+    {
+      if (auto payload = backing->find(key); payload != nullptr)
+      {
+        std::uint32_t ret = 0;
+        for (int y = 0; y < chunk_size; ++y)
+        {
+          auto index = static_cast<std::size_t>(y * chunk_size + x);
+          bool used = archive::test_bit(payload, index);
+          bool wall = used ? archive::test_bit(payload + archive::chunk_bitmap_size, index) : (generated >> y & 1);
+          ret |= static_cast<std::uint32_t>(wall) << y;
+        }
+        return ret;
+      }
+    }
+    return generated;
+  }
+  
+  // Bits [begin, end) of a word, 0 <= begin < end <= 32.
+  std::uint32_t bit_range(int begin, int end)
+  {
+    auto n = end - begin;
+    return (n == 32 ? ~std::uint32_t(0) : ((std::uint32_t(1) << n) - 1)) << begin;
+  }
+  
+  int Map::first_blocked_in_row(int y, int x_begin, int x_end) const
+  {
+    while (x_begin < x_end)
+    {
+      int chunk_x = x_begin >> chunk_shift;
+      int x0 = chunk_x * chunk_size;
+      int end = (std::min)(x_end - x0, chunk_size);
+      auto bits = blocked_row(chunk_x, y >> chunk_shift, y & (chunk_size - 1)) & bit_range(x_begin - x0, end);
+      if (bits != 0)
+      {
+        return x0 + std::countr_zero(bits);
+      }
+      x_begin = x0 + chunk_size;
+    }
+    return x_end;
+  }
+  
+  int Map::first_blocked_in_col(int x, int y_begin, int y_end) const
+  {
+    while (y_begin < y_end)
+    {
+      int chunk_y = y_begin >> chunk_shift;
+      int y0 = chunk_y * chunk_size;
+      int end = (std::min)(y_end - y0, chunk_size);
+      auto bits = blocked_col(x >> chunk_shift, chunk_y, x & (chunk_size - 1)) & bit_range(y_begin - y0, end);
+      if (bits != 0)
+      {
+        return y0 + std::countr_zero(bits);
+      }
+      y_begin = y0 + chunk_size;
+    }
+    return y_end;
+  }
+  
+  Point &Map::get(const Pos &pos)
+  {
+    auto &chunk = load_chunk(chunk_key(pos));
+    auto index = chunk_index(pos);
+    if (!chunk.used[index])
+    {
+      chunk.used.set(index);
+      ++chunk.used_count;
+    }
+    return chunk.points[index];
+  }
+  
+  void Map::erase(const Pos &pos)
+  {
+    auto it = chunks.find(chunk_key(pos));
+    if (it == chunks.end()) return;
+    auto index = chunk_index(pos);
+    if (!it->second.used[index]) return;
+    it->second.points[index] = Point();
+    it->second.used.reset(index);
+    refresh(it->second, pos);
+    if (--it->second.used_count == 0 && !is_stored(it->first))
+    {
+      chunks.erase(it);
+    }
+  }
   
   int Map::tank_up(const Pos &pos)
   {
@@ -178,49 +497,56 @@ namespace czh::map
     return tank_move(pos, 3);
   }
   
-  int Map::bullet_up(bullet::Bullet *b, const Pos &pos)
+  int Map::bullet_up(const bullet::BulletId &id, const Pos &pos)
   {
-    return bullet_move(b, pos, 0);
+    return bullet_move(id, pos, 0);
   }
   
-  int Map::bullet_down(bullet::Bullet *b, const Pos &pos)
+  int Map::bullet_down(const bullet::BulletId &id, const Pos &pos)
   {
-    return bullet_move(b, pos, 1);
+    return bullet_move(id, pos, 1);
   }
   
-  int Map::bullet_left(bullet::Bullet *b, const Pos &pos)
+  int Map::bullet_left(const bullet::BulletId &id, const Pos &pos)
   {
-    return bullet_move(b, pos, 2);
+    return bullet_move(id, pos, 2);
   }
   
-  int Map::bullet_right(bullet::Bullet *b, const Pos &pos)
+  int Map::bullet_right(const bullet::BulletId &id, const Pos &pos)
   {
-    return bullet_move(b, pos, 3);
+    return bullet_move(id, pos, 3);
   }
   
   
   int Map::add_tank(tank::Tank *t, const Pos &pos)
   {
-    map[pos].add_status(Status::TANK, t);
+    get(pos).add_status(Status::TANK, t);
+    refresh(pos);
     add_changes(pos);
     return 0;
   }
   
-  int Map::add_bullet(bullet::Bullet *b, const Pos &pos)
+  int Map::add_bullet(const bullet::BulletId &id, const Pos &pos)
   {
-    auto &p = map[pos];
+    auto &p = get(pos);
     if (p.has(Status::WALL)) return -1;
-    p.add_status(Status::BULLET, b);
+    p.bullets.push_back(id);
+    refresh(pos);
     add_changes(pos);
     return 0;
   }
   
   void Map::remove_status(const Status &status, const Pos &pos)
   {
-    map[pos].remove_status(status);
-    if (map[pos].is_temporary() && map[pos].is_empty())
+    auto &point = get(pos);
+    point.remove_status(status);
+    if (point.is_temporary() && point.is_empty())
     {
-      map.erase(pos);
+      erase(pos);
+    }
+    else
+    {
+      refresh(pos);
     }
     add_changes(pos);
   }
@@ -236,7 +562,9 @@ namespace czh::map
   }
   
   
-  const Point &generate(const Pos &i, size_t seed)
+  // Computes one row of generated terrain, starting at x0. The loop has no branches
+  // and no dependencies between iterations, so it can be vectorized.
+  std::uint32_t generate_row(int x0, int y, size_t seed)
   {
     constexpr int magic = 9;
     //   if(i.x / magic == 0 || i. y / magic == 0)
@@ -257,17 +585,96 @@ namespace czh::map
     //     if(seed * a % 5 == 1)
     //       return g::wall_point;
     //   }
-
-    int a = i.x * (i.y / magic);
-    if(a < 0) a = -a * 2;
-    if(seed * a % 37 == 1)
-      return g::wall_point;
-
-    a = (i.x / magic) * i.y;
-    if(a < 0) a = -a * 2;
-    if(seed * a % 37 == 1)
+    const int y_div = y / magic;
+    std::uint32_t row = 0;
+    for (int i = 0; i < chunk_size; ++i)
+    {
+      const int x = x0 + i;
+      int a = x * y_div;
+      a = a < 0 ? -a * 2 : a;
+      int b = (x / magic) * y;
+      b = b < 0 ? -b * 2 : b;
+      const bool wall = (seed * a % 37 == 1) | (seed * b % 37 == 1);
+      row |= static_cast<std::uint32_t>(wall) << i;
+    }
+    return row;
+  }
+  
+  // A small LRU cache of generated chunks for one seed. Every thread has its own,
+  // so lookups need no locking. Changing the seed drops the cached chunks.
+  class GeneratedCache
+  {
+  private:
+    static constexpr std::size_t capacity = 256;
+    
+    struct Entry
+    {
+      std::uint64_t key;
+      GeneratedChunk chunk;
+    };
+    
+    size_t seed = 0;
+    std::list<Entry> lru;
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index;
+  public:
+    const GeneratedChunk &get(int chunk_x, int chunk_y, size_t seed_)
+    {
+      if (seed_ != seed)
+      {
+        lru.clear();
+        index.clear();
+        seed = seed_;
+      }
+      auto key = chunk_key(chunk_x, chunk_y);
+      if (!lru.empty() && lru.front().key == key)
+      {
+        return lru.front().chunk;
+      }
+      if (auto it = index.find(key); it != index.end())
+      {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->chunk;
+      }
+      if (lru.size() >= capacity)
+      {
+        index.erase(lru.back().key);
+        lru.splice(lru.begin(), lru, std::prev(lru.end()));
+      }
+      else
+      {
+        lru.emplace_front();
+      }
+      auto &entry = lru.front();
+      entry.key = key;
+      entry.chunk.cols.fill(0);
+      for (int j = 0; j < chunk_size; ++j)
+      {
+        auto row = generate_row(chunk_x * chunk_size, chunk_y * chunk_size + j, seed);
+        entry.chunk.rows[j] = row;
+        for (; row != 0; row &= row - 1)
+        {
+          entry.chunk.cols[std::countr_zero(row)] |= std::uint32_t(1) << j;
+        }
+      }
+      index[key] = lru.begin();
+      return entry.chunk;
+    }
+  };
+  
+  thread_local GeneratedCache generated_cache;
+  
+  const GeneratedChunk &generate_chunk(int chunk_x, int chunk_y, size_t seed)
+  {
+    return generated_cache.get(chunk_x, chunk_y, seed);
+  }
+  
+  const Point &generate(const Pos &i, size_t seed)
+  {
+    auto &chunk = generate_chunk(i.x >> chunk_shift, i.y >> chunk_shift, seed);
+    if (chunk.rows[i.y & (chunk_size - 1)] >> (i.x & (chunk_size - 1)) & 1)
+    {
       return g::wall_point;
-
+    }
     return g::empty_point;
   }
 
@@ -283,32 +690,302 @@ namespace czh::map
   
   const Point &Map::at(const Pos &i) const
   {
-    if (map.find(i) != map.end())
+    if (auto it = chunks.find(chunk_key(i)); it != chunks.end())
+    {
+      auto index = chunk_index(i);
+      if (it->second.used[index])
+      {
+        return it->second.points[index];
+      }
+    }
+    else if (backing != nullptr)
     {
-      return map.at(i);
+      static const Point stored_wall = []
+      {
+        Point p;
+        p.add_status(Status::WALL, nullptr);
+        p.flags &= ~Point::TEMPORARY;
+        return p;
+      }();
+      static const Point stored_empty = []
+      {
+        Point p;
+        p.flags &= ~Point::TEMPORARY;
+        return p;
+      }();
+      if (auto payload = backing->find(chunk_key(i)); payload != nullptr)
+      {
+        auto index = chunk_index(i);
+        if (archive::test_bit(payload, index))
+        {
+          return archive::test_bit(payload + archive::chunk_bitmap_size, index) ? stored_wall : stored_empty;
+        }
+      }
     }
     return generate(i, g::seed);
   }
   
-  int Map::fill(const Zone &zone, const Status &status)
+  std::uint64_t Map::get_version(const Zone &zone) const
+  {
+    std::uint64_t ret = epoch;
+    for_each_chunk(zone, [this, &ret](std::uint64_t key, const Zone &)
+    {
+      if (auto it = versions.find(key); it != versions.end())
+      {
+        ret = std::max(ret, it->second);
+      }
+    });
+    return ret;
+  }
+  
+  const std::unordered_map<std::uint64_t, Chunk> &Map::get_chunks() const
+  {
+    return chunks;
+  }
+  
+  const std::shared_ptr<const archive::WorldFile> &Map::get_backing() const
+  {
+    return backing;
+  }
+  
+  void Map::load(std::shared_ptr<const archive::WorldFile> file)
   {
-    for (int i = zone.x_min; i < zone.x_max; ++i)
+    chunks.clear();
+    backing = std::move(file);
+    versions.clear();
+    epoch = ++next_version;
+  }
+  
+  void Map::see(const Zone &zone, std::chrono::steady_clock::time_point now)
+  {
+    for_each_chunk(zone, [this, now](std::uint64_t key, const Zone &)
+    {
+      if (auto it = chunks.find(key); it != chunks.end())
+      {
+        it->second.last_seen = now;
+      }
+    });
+  }
+  
+  std::size_t Map::compact()
+  {
+    std::size_t ret = 0;
+    for (auto it = chunks.begin(); it != chunks.end();)
     {
-      for (int j = zone.y_min; j < zone.y_max; ++j)
+      auto &[key, chunk] = *it;
+      auto &generated = generate_chunk(static_cast<std::int32_t>(key >> 32),
+                                       static_cast<std::int32_t>(key & 0xffffffff), g::seed);
+      for (std::size_t i = 0; i < chunk.points.size(); ++i)
+      {
+        if (!chunk.used[i]) continue;
+        auto &point = chunk.points[i];
+        // Points that aren't temporary were filled, cleared or pasted, and are kept even if they
+        // are the same as the terrain, which changes with the seed.
+        if (!(point.flags & Point::TEMPORARY) || !point.is_empty()) continue;
+        // Nothing changes when the point is dropped, so neither do the blocked bits.
+        if (generated.rows[i >> chunk_shift] >> (i & (chunk_size - 1)) & 1) continue;
+        point = Point();
+        chunk.used.reset(i);
+        --chunk.used_count;
+        ++ret;
+      }
+      if (chunk.used_count == 0 && !is_stored(key))
       {
-        Pos p(i, j);
-        map[p].remove_all_statuses();
-        if (status != Status::END)
+        g::change_journal.add(chunk_zone(key));
+        it = chunks.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    compacted_points += ret;
+    return ret;
+  }
+  
+  std::vector<std::uint64_t> Map::get_cold_chunks(std::chrono::steady_clock::time_point before) const
+  {
+    std::vector<std::uint64_t> ret;
+    for (auto &[key, chunk]: chunks)
+    {
+      if (chunk.last_seen >= before) continue;
+      bool has_objects = false;
+      for (std::size_t i = 0; i < chunk.points.size() && !has_objects; ++i)
+      {
+        has_objects = chunk.used[i] && (chunk.points[i].flags & Point::TANK || !chunk.points[i].bullets.empty());
+      }
+      if (!has_objects)
+      {
+        ret.emplace_back(key);
+      }
+    }
+    return ret;
+  }
+  
+  void Map::unload(const std::vector<std::uint64_t> &keys, std::shared_ptr<const archive::WorldFile> file)
+  {
+    backing = std::move(file);
+    for (auto &key: keys)
+    {
+      // Nothing changes, but the published world should read it from the new backing.
+      g::change_journal.add(chunk_zone(key));
+      chunks.erase(key);
+    }
+    spilled_chunks += keys.size();
+  }
+  
+  void Map::reseed()
+  {
+    versions.clear();
+    epoch = ++next_version;
+    for (auto &[key, chunk]: chunks)
+    {
+      auto chunk_x = static_cast<std::int32_t>(key >> 32);
+      auto chunk_y = static_cast<std::int32_t>(key & 0xffffffff);
+      for (int j = 0; j < chunk_size; ++j)
+      {
+        for (int i = 0; i < chunk_size; ++i)
         {
-          map[p].add_status(status, nullptr);
+          refresh(chunk, Pos(chunk_x * chunk_size + i, chunk_y * chunk_size + j));
         }
-        map[p].temporary = false;
-        add_changes(p);
       }
     }
+  }
+  
+  MapStats Map::get_stats() const
+  {
+    return {
+        .loaded_chunks = chunks.size(),
+        // The nodes and the buckets of the hash table.
+        .loaded_bytes = chunks.size() * (sizeof(std::pair<const std::uint64_t, Chunk>) + 2 * sizeof(void *))
+                        + chunks.bucket_count() * sizeof(void *),
+        .stored_chunks = backing == nullptr ? 0 : backing->get_chunk_count(),
+        .compacted_points = compacted_points,
+        .spilled_chunks = spilled_chunks
+    };
+  }
+  
+  int Map::fill(const Zone &zone, const Status &status)
+  {
+    Point filled;
+    if (status != Status::END)
+    {
+      filled.add_status(status, nullptr);
+    }
+    filled.flags &= ~Point::TEMPORARY;
+    for_each_chunk(zone, [this, &filled](std::uint64_t key, const Zone &part)
+    {
+      auto &chunk = load_chunk(key);
+      if (part.x_max - part.x_min == chunk_size && part.y_max - part.y_min == chunk_size)
+      {
+        chunk.points.fill(filled);
+        chunk.used.set();
+        chunk.used_count = chunk.used.size();
+        chunk.blocked_rows.fill(filled.has(Status::WALL) ? ~std::uint32_t(0) : 0);
+        chunk.blocked_cols.fill(filled.has(Status::WALL) ? ~std::uint32_t(0) : 0);
+        versions[key] = ++next_version;
+        return;
+      }
+      for (int j = part.y_min; j < part.y_max; ++j)
+      {
+        for (int i = part.x_min; i < part.x_max; ++i)
+        {
+          auto index = chunk_index(Pos(i, j));
+          chunk.points[index] = filled;
+          if (!chunk.used[index])
+          {
+            chunk.used.set(index);
+            ++chunk.used_count;
+          }
+          refresh(chunk, Pos(i, j));
+        }
+      }
+    });
+    g::change_journal.add(zone);
     return 0;
   }
   
+  void Map::clear(const Zone &zone)
+  {
+    for_each_chunk(zone, [this](std::uint64_t key, const Zone &part)
+    {
+      if (is_stored(key))
+      {
+        load_chunk(key);
+      }
+      auto it = chunks.find(key);
+      if (it == chunks.end()) return;
+      auto &chunk = it->second;
+      for (int j = part.y_min; j < part.y_max; ++j)
+      {
+        for (int i = part.x_min; i < part.x_max; ++i)
+        {
+          auto index = chunk_index(Pos(i, j));
+          if (!chunk.used[index]) continue;
+          auto &point = chunk.points[index];
+          point.remove_status(Status::WALL);
+          point.flags |= Point::TEMPORARY;
+          if (point.is_empty())
+          {
+            point = Point();
+            chunk.used.reset(index);
+            --chunk.used_count;
+          }
+          refresh(chunk, Pos(i, j));
+        }
+      }
+      if (chunk.used_count == 0 && !is_stored(key))
+      {
+        chunks.erase(it);
+      }
+    });
+    g::change_journal.add(zone);
+  }
+  
+  Region Map::copy(const Zone &zone) const
+  {
+    Region ret{.width = zone.x_max - zone.x_min, .height = zone.y_max - zone.y_min, .walls = {}};
+    ret.walls.reserve(static_cast<std::size_t>(ret.width) * ret.height);
+    for (int j = zone.y_min; j < zone.y_max; ++j)
+    {
+      for (int i = zone.x_min; i < zone.x_max; ++i)
+      {
+        ret.walls.emplace_back(at(i, j).has(Status::WALL));
+      }
+    }
+    return ret;
+  }
+  
+  void Map::paste(const Region &region, const Pos &pos)
+  {
+    Zone zone{pos.x, pos.x + region.width, pos.y, pos.y + region.height};
+    Point wall;
+    wall.add_status(Status::WALL, nullptr);
+    wall.flags &= ~Point::TEMPORARY;
+    Point empty;
+    empty.flags &= ~Point::TEMPORARY;
+    for_each_chunk(zone, [this, &region, &pos, &wall, &empty](std::uint64_t key, const Zone &part)
+    {
+      auto &chunk = load_chunk(key);
+      for (int j = part.y_min; j < part.y_max; ++j)
+      {
+        auto row = static_cast<std::size_t>(j - pos.y) * region.width;
+        for (int i = part.x_min; i < part.x_max; ++i)
+        {
+          auto index = chunk_index(Pos(i, j));
+          chunk.points[index] = region.walls[row + (i - pos.x)] ? wall : empty;
+          if (!chunk.used[index])
+          {
+            chunk.used.set(index);
+            ++chunk.used_count;
+          }
+          refresh(chunk, Pos(i, j));
+        }
+      }
+    });
+    g::change_journal.add(zone);
+  }
+  
   int Map::tank_move(const Pos &pos, int direction)
   {
     Pos new_pos = pos;
@@ -332,22 +1009,27 @@ namespace czh::map
     
     if (at(new_pos).has(Status::WALL)) return -1;
     
-    auto &new_point = map[new_pos];
-    auto &old_point = map[pos];
+    auto &new_point = get(new_pos);
+    auto &old_point = get(pos);
     
     if (new_point.has(Status::TANK)) return -1;
     new_point.add_status(Status::TANK, old_point.tank);
     old_point.remove_status(Status::TANK);
+    refresh(new_pos);
     if (old_point.is_temporary() && old_point.is_empty())
     {
-      map.erase(pos);
+      erase(pos);
+    }
+    else
+    {
+      refresh(pos);
     }
     add_changes(pos);
     add_changes(new_pos);
     return 0;
   }
   
-  int Map::bullet_move(bullet::Bullet *b, const Pos &pos, int direction)
+  int Map::bullet_move(const bullet::BulletId &id, const Pos &pos, int direction)
   {
     Pos new_pos = pos;
     switch (direction)
@@ -370,40 +1052,16 @@ namespace czh::map
     
     if (at(new_pos).has(Status::WALL)) return -1;
     
-    auto &new_point = map[new_pos];
-    auto &old_point = map[pos];
-    bool ok = false;
-    for (auto it = old_point.bullets.begin(); it != old_point.bullets.end();)
-    {
-      if (*it == b)
-      {
-        it = old_point.bullets.erase(it);
-        ok = true;
-        break;
-      }
-      else
-      {
-        ++it;
-      }
-    }
-    utils::tank_assert(ok);
-    for (auto it = old_point.statuses.begin(); it != old_point.statuses.end();)
-    {
-      if (*it == Status::BULLET)
-      {
-        it = old_point.statuses.erase(it);
-        break;
-      }
-      else
-      {
-        ++it;
-      }
-    }
-    new_point.add_status(Status::BULLET, b);
+    auto &new_point = get(new_pos);
+    auto &old_point = get(pos);
+    auto it = std::find(old_point.bullets.begin(), old_point.bullets.end(), id);
+    utils::tank_assert(it != old_point.bullets.end());
+    old_point.bullets.erase(it);
+    new_point.bullets.push_back(id);
     
     if (old_point.is_temporary() && old_point.is_empty())
     {
-      map.erase(pos);
+      erase(pos);
     }
     add_changes(pos);
     add_changes(new_pos);
@@ -24,6 +24,7 @@
 #include <string>
 #include <vector>
 #include <csignal>
+#include <iostream>
 
 using namespace czh;
 
@@ -51,12 +52,28 @@ void sighandler(int)
 }
 #endif
 
-int main()
+int main(int argc, char **argv)
 {
+  if (argc == 3 && std::string(argv[1]) == "--record")
+  {
+    if (g::recorder.start(argv[2]) != 0)
+    {
+      std::cerr << "Can not open " << argv[2] << "." << std::endl;
+      return 1;
+    }
+  }
+  else if (argc != 1)
+  {
+    std::cerr << "Usage: " << argv[0] << " [--record <file>]" << std::endl;
+    return 1;
+  }
 #ifdef SIGCONT
   signal(SIGCONT, sighandler);
 #endif
-  std::thread game_thread(
+  g::keyboard.init();
+  std::thread game_thread(game::run_mainloop);
+  // Rendering only reads the published world, or the client's snapshot.
+  std::thread drawing_thread(
       []
       {
         std::chrono::steady_clock::time_point beg, end;
@@ -64,38 +81,38 @@ int main()
         while (true)
         {
           beg = std::chrono::steady_clock::now();
-          if (g::game_mode == game::GameMode::NATIVE)
+          if (g::game_mode == game::GameMode::CLIENT || drawing::update_snapshot() == 0)
           {
-            game::mainloop();
+            drawing::draw();
           }
-          else if (g::game_mode == game::GameMode::SERVER)
+          end = std::chrono::steady_clock::now();
+          cost = std::chrono::duration_cast<std::chrono::milliseconds>(end - beg);
+          if (g::tick > cost)
           {
-            game::mainloop();
-            std::vector<size_t> disconnected;
-            for (auto &r: g::userdata)
-            {
-              if (r.first == 0) continue;
-              auto d = std::chrono::duration_cast<std::chrono::seconds>
-                  (std::chrono::steady_clock::now() - r.second.last_update);
-              if (d.count() > 5)
-              {
-                disconnected.emplace_back(r.first);
-              }
-            }
-            for (auto &r: disconnected)
-            {
-              msg::info(-1, g::userdata[r].ip + " (" + std::to_string(r) + ") disconnected.");
-              g::tanks[r]->kill();
-              g::tanks[r]->clear();
-              delete g::tanks[r];
-              g::tanks.erase(r);
-              g::userdata.erase(r);
-            }
+            std::this_thread::sleep_for(g::tick - cost);
           }
-          else
+        }
+      }
+  );
+  // A slow round-trip to the server only delays the client's own snapshot.
+  std::thread client_thread(
+      []
+      {
+        std::chrono::steady_clock::time_point beg, end;
+        std::chrono::milliseconds cost;
+        while (true)
+        {
+          beg = std::chrono::steady_clock::now();
+          if (g::game_mode == game::GameMode::CLIENT)
           {
-            if (g::client_failed_attempts > 10)
+            if (g::online_client.update() == 0)
+            {
+              g::client_failed_attempts = 0;
+            }
+            else if (++g::client_failed_attempts > 10)
             {
+              std::lock_guard<std::mutex> l1(g::drawing_mtx);
+              std::lock_guard<std::mutex> l2(g::mainloop_mtx);
               g::online_client.disconnect();
               g::game_mode = game::GameMode::NATIVE;
               g::userdata[0].messages = g::userdata[g::user_id].messages;
@@ -106,9 +123,6 @@ int main()
               msg::critical(g::user_id, "Disconnected due to network issues.");
             }
           }
-          auto ret = drawing::update_snapshot();
-          if (ret == 0) drawing::draw();
-          
           end = std::chrono::steady_clock::now();
           cost = std::chrono::duration_cast<std::chrono::milliseconds>(end - beg);
           if (g::tick > cost)
@@ -118,7 +132,10 @@ int main()
         }
       }
   );
-  game::add_tank({0, 0});
+  {
+    std::lock_guard<std::mutex> l(g::mainloop_mtx);
+    game::add_tank({0, 0});
+  }
   while (true)
   {
     input::Input i = input::get_input();
@@ -247,10 +264,7 @@ int main()
             for (auto &r: g::userdata)
             {
               if (r.first == 0) continue;
-              g::tanks[r.first]->kill();
-              g::tanks[r.first]->clear();
-              delete g::tanks[r.first];
-              g::tanks.erase(r.first);
+              game::remove_tank(r.first);
             }
             g::userdata = {{0, g::userdata[0]}};
             g::game_mode = game::GameMode::NATIVE;
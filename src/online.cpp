@@ -21,6 +21,7 @@
 #include "tank/drawing.h"
 #include "tank/utils.h"
 #include "tank/serialization.h"
+#include "tank/profile.h"
 
 #include <string>
 #include <string_view>
@@ -34,6 +35,7 @@ namespace czh::g
   online::TankClient online_client{};
   int client_failed_attempts = 0;
   int delay = 0;
+  std::size_t max_clients = 0;
   std::mutex online_mtx;
 }
 namespace czh::online
@@ -328,10 +330,10 @@ namespace czh::online
   
   const auto &Res::get_content() const { return content; }
   
-  TCPServer::TCPServer() : thpool(16) {}
+  TCPServer::TCPServer() : thpool(16), connections(0), max_connections(0) {}
   
   TCPServer::TCPServer(std::function<void(const Req &, Res &)> router_)
-      : router(std::move(router_)), thpool(16), running(false) {}
+      : router(std::move(router_)), thpool(16), running(false), connections(0), max_connections(0) {}
   
   void TCPServer::init(const std::function<void(const Req &, Res &)> &router_)
   {
@@ -351,8 +353,11 @@ namespace czh::online
       auto tmp = socket.accept();
       auto &[clnt_socket_, clnt_addr] = tmp;
       utils::tank_assert(clnt_socket_.get_fd() != -1, "socket accept failed");
+      // Refused by closing the socket, so the client's register fails.
+      if (max_connections != 0 && connections >= max_connections) continue;
       auto fd = clnt_socket_.release();
       sockets.emplace_back(fd);
+      ++connections;
       thpool.add_task(
           [this, fd]
           {
@@ -373,6 +378,7 @@ namespace czh::online
                 check(clnt_socket.send(response.get_content()) == 0);
               }
             }
+            --connections;
           });
     }
   }
@@ -391,6 +397,11 @@ namespace czh::online
     running = false;
   }
   
+  void TCPServer::set_max_connections(std::size_t n)
+  {
+    max_connections = n;
+  }
+  
   TCPServer::~TCPServer()
   {
     stop();
@@ -458,6 +469,7 @@ namespace czh::online
     svr->init([](const Req &req, Res &res)
               {
                 auto[cmd, args] = ser::deserialize<std::string, std::string>(req.get_content());
+                profile::Timer t(profile::request_phase(cmd));
                 if (cmd == "tank_react")
                 {
                   auto[id, event] = ser::deserialize<size_t, tank::NormalTankEvent>(args);
@@ -467,22 +479,23 @@ namespace czh::online
                 {
                   auto[id, zone] = ser::deserialize<size_t, map::Zone>(args);
                   auto beg = std::chrono::steady_clock::now();
-                  std::lock_guard<std::mutex> l(g::mainloop_mtx);
-                  std::set<map::Pos> changes;
-                  for (auto &r: g::userdata[id].map_changes)
+                  auto world = drawing::get_world();
+                  std::size_t version;
+                  decltype(g::userdata[id].messages) messages;
                   {
-                    if (zone.contains(r))
-                    {
-                      changes.insert(r);
-                    }
+                    std::lock_guard<std::mutex> l(g::mainloop_mtx);
+                    auto &user = g::userdata[id];
+                    version = std::exchange(user.world_version, world->version);
+                    std::swap(messages, user.messages);
+                    user.visible_zone = zone;
+                    user.last_update = std::chrono::steady_clock::now();
                   }
+                  std::vector<map::Zone> changes;
+                  bool resync = !world->read_changes(version, zone, changes);
                   auto d = std::chrono::duration_cast<std::chrono::milliseconds>
                       (std::chrono::steady_clock::now() - beg);
-                  res.set_content(make_response(d.count(), changes, drawing::extract_tanks(),
-                                                g::userdata[id].messages, drawing::extract_map(zone)));
-                  g::userdata[id].messages = decltype(g::userdata[id].messages){};
-                  g::userdata[id].map_changes.clear();
-                  g::userdata[id].last_update = std::chrono::steady_clock::now();
+                  res.set_content(make_response(d.count(), resync, changes, world->get_tanks(),
+                                                messages, world->extract_map(zone)));
                 }
                 else if (cmd == "register")
                 {
@@ -497,6 +510,7 @@ namespace czh::online
                       .screen_width = screen_width,
                       .screen_height = screen_height
                   };
+                  g::userdata[id].world_version = drawing::get_world()->version;
                   g::userdata[id].last_update = std::chrono::steady_clock::now();
                   msg::info(-1, req.get_addr().ip() + " connected as " + std::to_string(id));
                   res.set_content(make_response(id));
@@ -506,10 +520,7 @@ namespace czh::online
                   auto id = ser::deserialize<size_t>(args);
                   std::lock_guard<std::mutex> l(g::mainloop_mtx);
                   msg::info(-1, req.get_addr().ip() + " (" + std::to_string(id) + ") disconnected.");
-                  g::tanks[id]->kill();
-                  g::tanks[id]->clear();
-                  delete g::tanks[id];
-                  g::tanks.erase(id);
+                  game::remove_tank(id);
                   g::userdata.erase(id);
                 }
                 else if (cmd == "add_auto_tank")
@@ -528,6 +539,7 @@ namespace czh::online
   
   void TankServer::start(int port)
   {
+    svr->set_max_connections(g::max_clients);
     std::thread th{
         [this, port] { svr->start(port); }
     };
@@ -588,10 +600,20 @@ namespace czh::online
   
   int TankClient::update()
   {
-    std::lock_guard<std::mutex> l(g::online_mtx);
+    map::Zone zone;
+    {
+      std::lock_guard<std::mutex> l(g::drawing_mtx);
+      zone = g::visible_zone.bigger_zone(10);
+    }
     auto beg = std::chrono::steady_clock::now();
-    std::string content = make_request("update", g::user_id, g::visible_zone.bigger_zone(10));
-    auto ret = cli->send_and_recv(content);
+    std::optional<std::string> ret;
+    {
+      std::lock_guard<std::mutex> l(g::online_mtx);
+      if (cli == nullptr) return -1;
+      std::string content = make_request("update", g::user_id, zone);
+      ret = cli->send_and_recv(content);
+    }
+    std::lock_guard<std::mutex> l(g::drawing_mtx);
     if (!ret.has_value())
     {
       g::delay = -1;
@@ -599,21 +621,35 @@ namespace czh::online
       return -1;
     }
     int delay;
-    auto old_seed = g::snapshot.map.seed;
+    bool resync;
+    std::vector<map::Zone> changes;
+    std::map<size_t, drawing::TankView> tanks;
     std::priority_queue<msg::Message> msgs;
-    std::tie(delay, g::snapshot.changes, g::snapshot.tanks, msgs, g::snapshot.map)
-        = ser::deserialize<int, std::set<map::Pos>, std::map<size_t, drawing::TankView>,
+    drawing::MapView map;
+    std::tie(delay, resync, changes, tanks, msgs, map)
+        = ser::deserialize<int, bool, std::vector<map::Zone>, std::map<size_t, drawing::TankView>,
         std::priority_queue<msg::Message>,
         drawing::MapView>(*ret);
     int curr_delay = std::chrono::duration_cast<std::chrono::milliseconds>
                          (std::chrono::steady_clock::now() - beg).count() - delay;
     g::delay = static_cast<int>((g::delay + 0.1 * curr_delay) / 1.1);
+    if (resync || map.seed != g::snapshot.map.seed) g::output_inited = false;
+    // The changes are kept until they are drawn, which may be after several updates.
+    g::snapshot.changes.insert(g::snapshot.changes.end(), changes.begin(), changes.end());
+    if (g::snapshot.changes.size() > 4096)
+    {
+      g::snapshot.changes.clear();
+      g::output_inited = false;
+    }
+    g::snapshot.tanks = std::move(tanks);
+    g::snapshot.map = std::move(map);
+    g::snapshot.zone = zone;
+    std::lock_guard<std::mutex> ml(g::mainloop_mtx);
     while (!msgs.empty())
     {
       g::userdata[g::user_id].messages.push(msgs.top());
       msgs.pop();
     }
-    if (old_seed != g::snapshot.map.seed) g::output_inited = false;
     return 0;
   }
   
@@ -0,0 +1,560 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/path.h"
+#include "tank/globals.h"
+#include "tank/game.h"
+#include <algorithm>
+#include <limits>
+
+namespace czh::g
+{
+  path::FlowFields flow_fields;
+  path::PathCache path_cache;
+  path::PathJobs path_jobs;
+  std::size_t path_budget = path::default_path_budget;
+}
+
+namespace czh::path
+{
+  PathFinder::PathFinder() : cells{}, search(0), order(0)
+  {
+    heap.reserve(cells.size());
+  }
+
+  std::optional<std::vector<tank::AutoTankEvent>>
+  PathFinder::find(const map::Pos &start_, const map::Pos &dest_, const std::vector<map::Pos> &goals)
+  {
+    begin(start_, dest_, goals);
+    auto budget = std::numeric_limits<std::size_t>::max();
+    resume(budget);
+    return std::move(result);
+  }
+  
+  void PathFinder::begin(const map::Pos &start_, const map::Pos &dest_, const std::vector<map::Pos> &goals)
+  {
+    if (++search == 0)
+    {
+      for (auto &c: cells)
+      {
+        c.search = 0;
+      }
+      search = 1;
+    }
+    start = start_;
+    dest = dest_;
+    heap.clear();
+    result.reset();
+    for (auto &goal: goals)
+    {
+      // The others can't be reached.
+      if (int i = index_of(goal); i >= 0)
+      {
+        touch(i).goal = true;
+      }
+    }
+    order = 0;
+    int root = index_of(start);
+    auto &root_cell = touch(root);
+    root_cell.F = get_H(start);
+    root_cell.order = order++;
+    push(root);
+  }
+  
+  bool PathFinder::resume(std::size_t &budget)
+  {
+    auto check = [](const map::Pos &pos)
+    {
+      return !g::game_map.has(map::Status::WALL, pos) && !g::game_map.has(map::Status::TANK, pos);
+    };
+    
+    while (!heap.empty())
+    {
+      if (budget == 0) return false;
+      --budget;
+      int curr = pop();
+      int G = cells[curr].G + step_cost;
+      if (G > max_cost) continue;
+      auto curr_pos = pos_of(curr);
+      int found = -1;
+      for (auto &pos: {map::Pos(curr_pos.x, curr_pos.y + 1), map::Pos(curr_pos.x, curr_pos.y - 1),
+                       map::Pos(curr_pos.x - 1, curr_pos.y), map::Pos(curr_pos.x + 1, curr_pos.y)})
+      {
+        if (!check(pos)) continue;
+        int i = index_of(pos);
+        auto &cell = touch(i);
+        if (cell.closed) continue;
+        if (cell.heap_index < 0)
+        {
+          cell.G = G;
+          cell.F = G + get_H(pos);
+          cell.order = order++;
+          cell.parent = curr;
+          push(i);
+        }
+        // Only a G worse by more than a step is replaced, and the cell becomes the start of its
+        // own way. That's how the ways have always been found, so it is kept as it is.
+        else if (cell.G > G + step_cost)
+        {
+          cell.G = G + step_cost;
+          cell.F = cell.G + get_H(pos);
+          cell.order = order++;
+          cell.parent = i;
+          sift_up(static_cast<std::size_t>(cell.heap_index));
+        }
+        else continue;
+        // Any goal in the open list is found right after it gets in, so the first goal in the
+        // open list is one of these.
+        if (cell.goal && (found < 0 || before(i, found)))
+        {
+          found = i;
+        }
+      }
+      if (found >= 0)
+      {
+        std::vector<tank::AutoTankEvent> way;
+        for (int i = found; cells[i].parent != -1 && cells[i].parent != i; i = cells[i].parent)
+        {
+          way.emplace_back(tank::get_pos_direction(pos_of(cells[i].parent), pos_of(i)));
+        }
+        std::reverse(way.begin(), way.end());
+        result = std::move(way);
+        heap.clear();
+        return true;
+      }
+    }
+    return true;
+  }
+  
+  std::optional<std::vector<tank::AutoTankEvent>> &PathFinder::get_result()
+  {
+    return result;
+  }
+
+  int PathFinder::get_H(const map::Pos &pos) const
+  {
+    return static_cast<int>(map::get_distance(dest, pos)) * step_cost;
+  }
+  
+  int PathFinder::index_of(const map::Pos &pos) const
+  {
+    int x = pos.x - start.x + max_steps;
+    int y = pos.y - start.y + max_steps;
+    if (x < 0 || x >= window_size || y < 0 || y >= window_size) return -1;
+    return y * window_size + x;
+  }
+
+  map::Pos PathFinder::pos_of(int index) const
+  {
+    return {start.x + index % window_size - max_steps, start.y + index / window_size - max_steps};
+  }
+
+  PathFinder::Cell &PathFinder::touch(int index)
+  {
+    auto &cell = cells[index];
+    if (cell.search != search)
+    {
+      cell = Cell{.search = search, .G = 0, .F = 0, .order = 0, .parent = -1, .heap_index = -1,
+                  .closed = false, .goal = false};
+    }
+    return cell;
+  }
+
+  bool PathFinder::before(int a, int b) const
+  {
+    return cells[a].F < cells[b].F || (cells[a].F == cells[b].F && cells[a].order < cells[b].order);
+  }
+
+  void PathFinder::push(int index)
+  {
+    cells[index].heap_index = static_cast<int>(heap.size());
+    heap.emplace_back(index);
+    sift_up(heap.size() - 1);
+  }
+
+  int PathFinder::pop()
+  {
+    int ret = heap.front();
+    heap.front() = heap.back();
+    cells[heap.front()].heap_index = 0;
+    heap.pop_back();
+    if (!heap.empty())
+    {
+      sift_down(0);
+    }
+    cells[ret].heap_index = -1;
+    cells[ret].closed = true;
+    return ret;
+  }
+
+  void PathFinder::sift_up(std::size_t i)
+  {
+    int index = heap[i];
+    while (i > 0)
+    {
+      auto parent = (i - 1) / 2;
+      if (!before(index, heap[parent])) break;
+      heap[i] = heap[parent];
+      cells[heap[i]].heap_index = static_cast<int>(i);
+      i = parent;
+    }
+    heap[i] = index;
+    cells[index].heap_index = static_cast<int>(i);
+  }
+
+  void PathFinder::sift_down(std::size_t i)
+  {
+    int index = heap[i];
+    while (true)
+    {
+      auto child = 2 * i + 1;
+      if (child >= heap.size()) break;
+      if (child + 1 < heap.size() && before(heap[child + 1], heap[child])) ++child;
+      if (!before(heap[child], index)) break;
+      heap[i] = heap[child];
+      cells[heap[i]].heap_index = static_cast<int>(i);
+      i = child;
+    }
+    heap[i] = index;
+    cells[index].heap_index = static_cast<int>(i);
+  }
+
+  PathFinder &get_path_finder()
+  {
+    static PathFinder finder;
+    return finder;
+  }
+
+  FlowField::FlowField() : range(0), radius(0), version(0), built_tick(0), ready(false) {}
+  
+  std::size_t FlowField::build(const map::Pos &target_pos_, int range_)
+  {
+    target_pos = target_pos_;
+    range = range_;
+    // The fire line is within range - 1 of the target, and a chaser is at most max_steps away.
+    radius = range - 1 + max_steps;
+    version = g::game_map.get_version(get_window());
+    built_tick = g::tick_count;
+    ready = true;
+    steps.assign(static_cast<std::size_t>((2 * radius + 1) * (2 * radius + 1)), -1);
+    
+    auto check = [](const map::Pos &pos)
+    {
+      return !g::game_map.has(map::Status::WALL, pos) && !g::game_map.has(map::Status::TANK, pos);
+    };
+    std::vector<map::Pos> curr;
+    for (auto &pos: tank::get_fire_line(range, target_pos))
+    {
+      if (!check(pos)) continue;
+      steps[index_of(pos)] = 0;
+      curr.emplace_back(pos);
+    }
+    std::size_t reached = curr.size();
+    // A chaser takes one step into the field, so the field only needs max_steps - 1 more.
+    std::vector<map::Pos> next;
+    for (int s = 1; s < max_steps && !curr.empty(); ++s)
+    {
+      next.clear();
+      for (auto &p: curr)
+      {
+        for (auto &pos: {map::Pos(p.x, p.y + 1), map::Pos(p.x, p.y - 1),
+                         map::Pos(p.x - 1, p.y), map::Pos(p.x + 1, p.y)})
+        {
+          int i = index_of(pos);
+          if (i < 0 || steps[i] != -1 || !check(pos)) continue;
+          steps[i] = s;
+          next.emplace_back(pos);
+        }
+      }
+      reached += next.size();
+      std::swap(curr, next);
+    }
+    return reached;
+  }
+  
+  const map::Pos &FlowField::get_target_pos() const
+  {
+    return target_pos;
+  }
+  
+  bool FlowField::is_stale(const map::Pos &target_pos_) const
+  {
+    return target_pos != target_pos_ || g::game_map.get_version(get_window()) != version;
+  }
+  
+  std::optional<std::vector<tank::AutoTankEvent>>
+  FlowField::find(const map::Pos &start, map::Pos &dest) const
+  {
+    // The start has the chaser itself, so it is never in the field.
+    auto curr = start;
+    int curr_steps = max_steps;
+    std::vector<tank::AutoTankEvent> way;
+    while (curr_steps > 0)
+    {
+      auto next = curr;
+      int next_steps = curr_steps;
+      for (auto &pos: {map::Pos(curr.x, curr.y + 1), map::Pos(curr.x, curr.y - 1),
+                       map::Pos(curr.x - 1, curr.y), map::Pos(curr.x + 1, curr.y)})
+      {
+        int s = steps_at(pos);
+        if (s >= 0 && s < next_steps)
+        {
+          next = pos;
+          next_steps = s;
+        }
+      }
+      if (next == curr) return std::nullopt;
+      way.emplace_back(tank::get_pos_direction(curr, next));
+      curr = next;
+      curr_steps = next_steps;
+    }
+    dest = curr;
+    return way;
+  }
+  
+  map::Zone FlowField::get_window() const
+  {
+    return {target_pos.x - radius, target_pos.x + radius + 1, target_pos.y - radius, target_pos.y + radius + 1};
+  }
+  
+  int FlowField::index_of(const map::Pos &pos) const
+  {
+    int x = pos.x - target_pos.x + radius;
+    int y = pos.y - target_pos.y + radius;
+    if (x < 0 || x > 2 * radius || y < 0 || y > 2 * radius) return -1;
+    return y * (2 * radius + 1) + x;
+  }
+  
+  int FlowField::steps_at(const map::Pos &pos) const
+  {
+    int i = index_of(pos);
+    return i < 0 ? -1 : steps[i];
+  }
+  
+  FlowFields::FlowFields() : rebuilt(0), reached(0) {}
+  
+  void FlowFields::update(std::size_t &budget)
+  {
+    rebuilt = 0;
+    reached = 0;
+    std::map<std::pair<std::size_t, int>, std::size_t> chasers;
+    g::tanks.for_each_alive<tank::AutoTank>([&chasers](tank::AutoTank &t)
+    {
+      if (!t.has_target()) return;
+      auto target = game::id_at(t.get_target_id());
+      if (target == nullptr || !target->is_alive() || t.get_info().bullet.range > max_field_range
+          || map::get_distance(target->get_pos(), t.get_pos()) > 30)
+        return;
+      ++chasers[{t.get_target_id(), t.get_info().bullet.range}];
+    });
+    std::erase_if(fields, [&chasers](auto &&f)
+    {
+      auto it = chasers.find(f.first);
+      return it == chasers.end() || it->second < hot_chasers;
+    });
+    // Every tank moving in a window makes its field stale, so there may be far more to rebuild
+    // than the budget allows.
+    std::vector<std::tuple<FlowField *, const map::Pos *, int>> stale;
+    for (auto &[key, count]: chasers)
+    {
+      if (count < hot_chasers) continue;
+      auto &target_pos = game::id_at(key.first)->get_pos();
+      auto [it, inserted] = fields.try_emplace(key);
+      if (inserted || it->second.is_stale(target_pos))
+      {
+        it->second.ready = false;
+        stale.emplace_back(&it->second, &target_pos, key.second);
+      }
+    }
+    std::stable_sort(stale.begin(), stale.end(),
+                     [](auto &&a, auto &&b) { return std::get<0>(a)->built_tick < std::get<0>(b)->built_tick; });
+    for (auto &[field, target_pos, range]: stale)
+    {
+      if (budget == 0) break;
+      auto n = field->build(*target_pos, range);
+      budget -= std::min(n, budget);
+      ++rebuilt;
+      reached += n;
+    }
+  }
+  
+  const FlowField *FlowFields::get(std::size_t target_id, int range) const
+  {
+    auto it = fields.find({target_id, range});
+    return it == fields.end() || !it->second.ready ? nullptr : &it->second;
+  }
+  
+  std::pair<std::size_t, std::size_t> FlowFields::get_rebuilt() const
+  {
+    return {rebuilt, reached};
+  }
+  
+  std::size_t FlowFields::size() const
+  {
+    return fields.size();
+  }
+  
+  void FlowFields::clear()
+  {
+    fields.clear();
+  }
+  
+  map::Zone get_window(const map::Pos &start)
+  {
+    return {start.x - max_steps, start.x + max_steps + 1, start.y - max_steps, start.y + max_steps + 1};
+  }
+  
+  PathCache::PathCache() : hits(0), misses(0), stale(0) {}
+  
+  std::optional<CachedWay> PathCache::find(const PathKey &key, std::uint64_t version)
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    auto it = entries.find(key);
+    if (it == entries.end())
+    {
+      ++misses;
+      return std::nullopt;
+    }
+    if (it->second.version != version)
+    {
+      ++misses;
+      ++stale;
+      entries.erase(it);
+      return std::nullopt;
+    }
+    ++hits;
+    return it->second.result;
+  }
+  
+  void PathCache::insert(const PathKey &key, std::uint64_t version, CachedWay result)
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    if (entries.size() >= path_cache_capacity)
+    {
+      entries.clear();
+    }
+    entries.insert_or_assign(key, Entry{.version = version, .result = std::move(result)});
+  }
+  
+  PathCacheStats PathCache::get_stats() const
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    return {.entries = entries.size(), .hits = hits, .misses = misses, .stale = stale};
+  }
+  
+  PathJobs::PathJobs() : expanded(0), finished(0), total_wait(0) {}
+  
+  void PathJobs::request(std::size_t tank_id, const map::Pos &target_pos)
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    if (auto it = queued.find(tank_id); it != queued.end())
+    {
+      auto &job = jobs.at(it->second);
+      if (job.target_pos != target_pos)
+      {
+        job.target_pos = target_pos;
+        job.started = false;
+      }
+      return;
+    }
+    std::pair<std::size_t, std::size_t> key{g::tick_count, tank_id};
+    jobs.emplace(key, Job{.tank_id = tank_id, .target_pos = target_pos, .started = false,
+                          .key = {}, .version = 0, .dest = {}});
+    queued.emplace(tank_id, key);
+  }
+  
+  void PathJobs::cancel(std::size_t tank_id)
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    if (auto it = queued.find(tank_id); it != queued.end())
+    {
+      jobs.erase(it->second);
+      queued.erase(it);
+    }
+  }
+  
+  void PathJobs::run(std::size_t &budget)
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    expanded = 0;
+    finished = 0;
+    total_wait = 0;
+    while (!jobs.empty() && budget > 0)
+    {
+      auto it = jobs.begin();
+      auto &job = it->second;
+      auto pop = [this, &it]
+      {
+        queued.erase(it->second.tank_id);
+        jobs.erase(it);
+      };
+      auto tank = game::id_at(job.tank_id);
+      if (tank == nullptr || !tank->is_alive() || !tank->is_auto())
+      {
+        pop();
+        continue;
+      }
+      auto atank = static_cast<tank::AutoTank *>(tank);
+      auto &start = atank->get_pos();
+      auto range = atank->get_info().bullet.range;
+      auto fire_line_version = tank::get_fire_line_version(range, job.target_pos);
+      auto version = std::max(fire_line_version, g::game_map.get_version(get_window(start)));
+      if (job.started && (std::get<0>(job.key) != start || job.version != version))
+      {
+        job.started = false;
+      }
+      if (!job.started)
+      {
+        auto &fire_line = atank->get_fire_line(job.target_pos, fire_line_version);
+        if (fire_line.empty())
+        {
+          pop();
+          continue;
+        }
+        job.key = {start, job.target_pos, range};
+        job.version = version;
+        job.dest = *std::min_element(fire_line.begin(), fire_line.end(),
+                                     [&start](auto &&a, auto &&b)
+                                     {
+                                       return map::get_distance(a, start) < map::get_distance(b, start);
+                                     });
+        finder.begin(start, job.dest, fire_line);
+        job.started = true;
+      }
+      auto left = budget;
+      bool done = finder.resume(budget);
+      expanded += left - budget;
+      if (!done) break;
+      g::path_cache.insert(job.key, job.version, {.dest = job.dest, .way = finder.get_result()});
+      atank->take_way(job.dest, std::move(finder.get_result()));
+      ++finished;
+      total_wait += g::tick_count - it->first.first;
+      pop();
+    }
+  }
+  
+  PathJobStats PathJobs::get_stats() const
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    return {.queued = jobs.size(),
+            .oldest_wait = jobs.empty() ? 0 : g::tick_count - jobs.begin()->first.first,
+            .expanded = expanded, .finished = finished, .total_wait = total_wait};
+  }
+  
+  void PathJobs::clear()
+  {
+    std::lock_guard<std::mutex> l(mtx);
+    jobs.clear();
+    queued.clear();
+  }
+}
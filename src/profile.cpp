@@ -0,0 +1,149 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/globals.h"
+#include "tank/profile.h"
+#include <bit>
+#include <fstream>
+#include <iomanip>
+
+namespace czh::g
+{
+  std::array<profile::Histogram, profile::phase_count> profile_histograms;
+}
+
+namespace czh::profile
+{
+  std::string_view get_name(Phase phase)
+  {
+    static constexpr std::array<std::string_view, phase_count> names{
+        "tick", "input", "path", "ai", "bullet", "collision", "clear_death",
+        "snapshot", "draw",
+        "tank_react", "update", "register", "deregister", "add_auto_tank", "run_command"
+    };
+    return names[static_cast<std::size_t>(phase)];
+  }
+
+  Phase request_phase(std::string_view cmd)
+  {
+    for (auto i = static_cast<std::size_t>(Phase::TANK_REACT); i < phase_count; ++i)
+    {
+      if (get_name(static_cast<Phase>(i)) == cmd)
+      {
+        return static_cast<Phase>(i);
+      }
+    }
+    return Phase::END;
+  }
+
+  std::size_t bucket_of(std::chrono::nanoseconds d)
+  {
+    auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(d.count(), 0));
+    if (ns < 4) return ns;
+    auto e = static_cast<std::size_t>(std::bit_width(ns) - 1);
+    return std::min(4 * (e - 1) + ((ns >> (e - 2)) & 3), Histogram::bucket_count - 1);
+  }
+
+  // The upper bound of the bucket.
+  std::chrono::nanoseconds bucket_limit(std::size_t bucket)
+  {
+    ++bucket;
+    if (bucket < 4) return std::chrono::nanoseconds(bucket);
+    auto e = bucket / 4 + 1;
+    return std::chrono::nanoseconds(static_cast<std::int64_t>((4 + bucket % 4) << (e - 2)));
+  }
+
+  void Histogram::add(std::chrono::nanoseconds d)
+  {
+    auto second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> l(mtx);
+    auto &w = windows[static_cast<std::size_t>(second) % window_count];
+    if (w.second != second)
+    {
+      w = Window{.second = second};
+    }
+    ++w.buckets[bucket_of(d)];
+    ++w.count;
+    w.max = std::max(w.max, d);
+  }
+
+  Stats Histogram::get_stats()
+  {
+    auto second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::array<std::size_t, bucket_count> buckets{};
+    Stats ret{.count = 0, .p50 = std::chrono::nanoseconds(0), .p99 = std::chrono::nanoseconds(0),
+              .max = std::chrono::nanoseconds(0)};
+    {
+      std::lock_guard<std::mutex> l(mtx);
+      for (auto &w: windows)
+      {
+        if (w.second <= second - static_cast<std::int64_t>(window_count)) continue;
+        for (std::size_t i = 0; i < bucket_count; ++i)
+        {
+          buckets[i] += w.buckets[i];
+        }
+        ret.count += w.count;
+        ret.max = std::max(ret.max, w.max);
+      }
+    }
+    if (ret.count == 0) return ret;
+    std::size_t seen = 0;
+    bool p50_found = false;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += buckets[i];
+      if (!p50_found && seen * 2 >= ret.count)
+      {
+        ret.p50 = std::min(bucket_limit(i), ret.max);
+        p50_found = true;
+      }
+      if (seen * 100 >= ret.count * 99)
+      {
+        ret.p99 = std::min(bucket_limit(i), ret.max);
+        break;
+      }
+    }
+    return ret;
+  }
+
+  Stats get_stats(Phase phase)
+  {
+    return g::profile_histograms[static_cast<std::size_t>(phase)].get_stats();
+  }
+
+  int dump(const std::string &path)
+  {
+    std::ofstream out(path);
+    if (!out.is_open()) return -1;
+    auto us = [](std::chrono::nanoseconds d) { return static_cast<double>(d.count()) / 1000; };
+    out << "# phase count p50_us p99_us max_us, in the last " << Histogram::window_count << " seconds\n";
+    out << std::fixed << std::setprecision(1);
+    for (std::size_t i = 0; i < phase_count; ++i)
+    {
+      auto stats = get_stats(static_cast<Phase>(i));
+      out << get_name(static_cast<Phase>(i)) << ' ' << stats.count << ' ' << us(stats.p50) << ' '
+          << us(stats.p99) << ' ' << us(stats.max) << '\n';
+    }
+    return out.good() ? 0 : -1;
+  }
+
+  Timer::Timer(Phase phase_) : phase(phase_), beg(std::chrono::steady_clock::now()) {}
+
+  Timer::~Timer()
+  {
+    if (phase == Phase::END) return;
+    g::profile_histograms[static_cast<std::size_t>(phase)].add(std::chrono::steady_clock::now() - beg);
+  }
+}
@@ -0,0 +1,464 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/replay.h"
+#include "tank/game.h"
+#include "tank/command.h"
+#include "tank/message.h"
+#include "tank/globals.h"
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <chrono>
+#include <cstring>
+
+namespace czh::g
+{
+  replay::Recorder recorder;
+  replay::Replayer replayer;
+}
+
+namespace czh::replay
+{
+  constexpr char magic[8] = {'T', 'A', 'N', 'K', 'R', 'P', 'L', 'Y'};
+
+  void write_varint(std::string &buf, std::uint64_t v)
+  {
+    while (v >= 0x80)
+    {
+      buf += static_cast<char>((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    buf += static_cast<char>(v);
+  }
+
+  void write_coord(std::string &buf, int v)
+  {
+    auto u = static_cast<std::uint32_t>(v);
+    write_varint(buf, (u << 1) ^ (v < 0 ? 0xffffffffu : 0));
+  }
+
+  void write_string(std::string &buf, const std::string &s)
+  {
+    write_varint(buf, s.size());
+    buf += s;
+  }
+
+  // Reads a replay file. Reading past the end makes it fail instead of throwing.
+  class Reader
+  {
+  private:
+    std::string_view data;
+    std::size_t pos;
+    bool failed;
+  public:
+    explicit Reader(std::string_view data_) : data(data_), pos(0), failed(false) {}
+
+    std::uint64_t varint()
+    {
+      std::uint64_t ret = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        if (pos >= data.size())
+        {
+          failed = true;
+          return 0;
+        }
+        auto byte = static_cast<unsigned char>(data[pos++]);
+        ret |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return ret;
+      }
+      failed = true;
+      return 0;
+    }
+
+    int coord()
+    {
+      auto u = static_cast<std::uint32_t>(varint());
+      return static_cast<int>((u >> 1) ^ (0u - (u & 1)));
+    }
+
+    map::Pos position()
+    {
+      int x = coord();
+      int y = coord();
+      return {x, y};
+    }
+
+    std::string string()
+    {
+      auto size = varint();
+      if (failed || size > data.size() - pos)
+      {
+        failed = true;
+        return "";
+      }
+      std::string ret(data.substr(pos, size));
+      pos += size;
+      return ret;
+    }
+
+    [[nodiscard]] std::size_t tell() const { return pos; }
+
+    void seek(std::size_t p) { pos = p; }
+
+    void invalidate() { failed = true; }
+
+    [[nodiscard]] bool eof() const { return pos >= data.size(); }
+
+    [[nodiscard]] bool fail() const { return failed; }
+  };
+
+  Recorder::Recorder() : last_tick(0), in_command(false) {}
+
+  int Recorder::start(const std::string &path)
+  {
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return -1;
+    buffer.assign(magic, sizeof(magic));
+    write_varint(buffer, replay_file_version);
+    write_varint(buffer, g::seed);
+    write_varint(buffer, g::next_id);
+    last_tick = g::tick_count;
+    flush();
+    return 0;
+  }
+
+  void Recorder::stop()
+  {
+    if (!is_recording()) return;
+    begin_record(RecordType::END);
+    write_varint(buffer, state_hash());
+    flush();
+    file.close();
+  }
+
+  bool Recorder::is_recording() const
+  {
+    return file.is_open();
+  }
+
+  void Recorder::input(std::size_t tank_id, tank::NormalTankEvent event)
+  {
+    if (!is_recording()) return;
+    begin_record(RecordType::INPUT);
+    write_varint(buffer, tank_id);
+    write_varint(buffer, static_cast<std::uint64_t>(event));
+  }
+
+  void Recorder::begin_command(std::size_t user_id, const std::string &command)
+  {
+    if (!is_recording()) return;
+    begin_record(RecordType::COMMAND);
+    write_varint(buffer, user_id);
+    write_string(buffer, command);
+    in_command = true;
+  }
+
+  void Recorder::end_command()
+  {
+    in_command = false;
+  }
+
+  void Recorder::pos(const map::Pos &pos)
+  {
+    if (!is_recording() || !in_command) return;
+    begin_record(RecordType::POS);
+    write_coord(buffer, pos.x);
+    write_coord(buffer, pos.y);
+  }
+
+  void Recorder::add_tank(std::size_t id, const map::Pos &pos)
+  {
+    if (!is_recording() || in_command) return;
+    begin_record(RecordType::ADD_TANK);
+    write_varint(buffer, id);
+    write_coord(buffer, pos.x);
+    write_coord(buffer, pos.y);
+  }
+
+  void Recorder::add_auto_tank(std::size_t id, std::size_t lvl, const map::Pos &pos)
+  {
+    if (!is_recording() || in_command) return;
+    begin_record(RecordType::ADD_AUTO_TANK);
+    write_varint(buffer, id);
+    write_varint(buffer, lvl);
+    write_coord(buffer, pos.x);
+    write_coord(buffer, pos.y);
+  }
+
+  void Recorder::remove_tank(std::size_t id)
+  {
+    if (!is_recording() || in_command) return;
+    begin_record(RecordType::REMOVE_TANK);
+    write_varint(buffer, id);
+  }
+
+  void Recorder::begin_record(RecordType type)
+  {
+    if (buffer.size() >= 1 << 16) flush();
+    std::size_t tick = g::tick_count;
+    write_varint(buffer, tick - last_tick);
+    last_tick = tick;
+    buffer += static_cast<char>(type);
+  }
+
+  void Recorder::flush()
+  {
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    file.flush();
+    buffer.clear();
+  }
+
+  Replayer::Replayer() : replaying(false) {}
+
+  int Replayer::run(std::size_t user_id, const std::string &path)
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+    {
+      msg::error(user_id, "Can not open " + path + ".");
+      return -1;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(magic) || std::memcmp(data.data(), magic, sizeof(magic)) != 0)
+    {
+      msg::error(user_id, path + " is not a replay file.");
+      return -1;
+    }
+    Reader reader(std::string_view(data).substr(sizeof(magic)));
+    auto version = reader.varint();
+    auto seed = reader.varint();
+    auto next_id = reader.varint();
+    if (reader.fail() || version != replay_file_version)
+    {
+      msg::error(user_id, "Unsupported replay file version.");
+      return -1;
+    }
+    {
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      g::seed = seed;
+      g::game_map.reseed();
+      g::next_id = next_id;
+    }
+
+    auto clear_messages = []
+    {
+      std::lock_guard<std::mutex> l(g::mainloop_mtx);
+      for (auto &r: g::userdata)
+      {
+        r.second.messages = {};
+      }
+    };
+
+    replaying = true;
+    auto beg = std::chrono::steady_clock::now();
+    std::size_t start_tick = g::tick_count;
+    std::size_t tick = start_tick;
+    bool diverged = false;
+    bool ended = false;
+    std::optional<std::uint64_t> recorded_hash;
+    while (!reader.eof() && !ended && !diverged)
+    {
+      tick += reader.varint();
+      auto type = static_cast<RecordType>(reader.varint());
+      if (reader.fail()) break;
+      while (g::tick_count < tick)
+      {
+        // Paused forever.
+        if (!g::game_running)
+        {
+          diverged = true;
+          break;
+        }
+        game::mainloop();
+        if (g::tick_count % 1024 == 0)
+        {
+          clear_messages();
+        }
+      }
+      if (diverged) break;
+
+      switch (type)
+      {
+        case RecordType::INPUT:
+        {
+          auto id = reader.varint();
+          auto event = static_cast<tank::NormalTankEvent>(reader.varint());
+          if (!g::input_queue.push({.tank_id = id, .event = event, .tick = g::tick_count,
+                                    .received = std::chrono::steady_clock::now()}))
+          {
+            diverged = true;
+          }
+        }
+          break;
+        case RecordType::COMMAND:
+        {
+          auto id = reader.varint();
+          auto command = reader.string();
+          positions.clear();
+          while (!reader.eof())
+          {
+            auto next = reader.tell();
+            if (reader.varint() != 0 || static_cast<RecordType>(reader.varint()) != RecordType::POS)
+            {
+              reader.seek(next);
+              break;
+            }
+            positions.emplace_back(reader.position());
+          }
+          if (reader.fail()) break;
+          cmd::run_command(id, command);
+          if (!positions.empty())
+          {
+            diverged = true;
+          }
+        }
+          break;
+        case RecordType::ADD_TANK:
+        {
+          auto id = reader.varint();
+          auto pos = reader.position();
+          if (reader.fail()) break;
+          std::lock_guard<std::mutex> l(g::mainloop_mtx);
+          if (g::game_map.has(map::Status::TANK, pos) || game::add_tank(pos) != id)
+          {
+            diverged = true;
+          }
+        }
+          break;
+        case RecordType::ADD_AUTO_TANK:
+        {
+          auto id = reader.varint();
+          auto lvl = reader.varint();
+          auto pos = reader.position();
+          if (reader.fail()) break;
+          std::lock_guard<std::mutex> l(g::mainloop_mtx);
+          if (g::game_map.has(map::Status::TANK, pos) || game::add_auto_tank(lvl, pos) != id)
+          {
+            diverged = true;
+          }
+        }
+          break;
+        case RecordType::REMOVE_TANK:
+        {
+          auto id = reader.varint();
+          if (reader.fail()) break;
+          std::lock_guard<std::mutex> l(g::mainloop_mtx);
+          if (g::tanks.at(id) == nullptr)
+          {
+            diverged = true;
+            break;
+          }
+          game::remove_tank(id);
+        }
+          break;
+        case RecordType::END:
+          recorded_hash = reader.varint();
+          ended = true;
+          break;
+        default:
+          reader.invalidate();
+          break;
+      }
+    }
+    replaying = false;
+    positions.clear();
+    clear_messages();
+
+    if (diverged)
+    {
+      msg::error(user_id, "The replay diverged at tick " + std::to_string(g::tick_count - start_tick) + ".");
+      return -1;
+    }
+    if (reader.fail())
+    {
+      msg::error(user_id, path + " is broken at tick " + std::to_string(g::tick_count - start_tick) + ".");
+      return -1;
+    }
+    auto d = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - beg);
+    auto ticks = g::tick_count - start_tick;
+    auto ticks_per_second = d.count() == 0 ? 0 : ticks * 1000000 / static_cast<std::size_t>(d.count());
+    auto hex = [](std::uint64_t v)
+    {
+      std::stringstream ss;
+      ss << std::hex << std::setw(16) << std::setfill('0') << v;
+      return ss.str();
+    };
+    auto hash = state_hash();
+    msg::info(user_id, "Replayed " + std::to_string(ticks) + " ticks in " + std::to_string(d.count() / 1000)
+                       + " ms, " + std::to_string(ticks_per_second) + " ticks per second.");
+    msg::info(user_id, "State hash: " + hex(hash) + ".");
+    if (!recorded_hash.has_value())
+    {
+      msg::warn(user_id, "The recording didn't end, so there is no hash to compare.");
+    }
+    else if (*recorded_hash != hash)
+    {
+      msg::warn(user_id, "The recorded state hash was " + hex(*recorded_hash) + ".");
+    }
+    return 0;
+  }
+
+  bool Replayer::is_replaying() const
+  {
+    return replaying;
+  }
+
+  std::optional<map::Pos> Replayer::next_pos()
+  {
+    if (positions.empty()) return std::nullopt;
+    auto ret = positions.front();
+    positions.pop_front();
+    return ret;
+  }
+
+  std::uint64_t state_hash()
+  {
+    std::uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](std::uint64_t v)
+    {
+      h = (h ^ v) * 1099511628211ULL;
+      h ^= h >> 32;
+    };
+    mix(g::tick_count);
+    mix(g::next_id);
+    for (std::size_t id = 0; id < g::next_id; ++id)
+    {
+      auto t = g::tanks.at(id);
+      if (t == nullptr)
+      {
+        mix(0);
+        continue;
+      }
+      mix(t->is_alive() ? 2 : 1);
+      mix(static_cast<std::uint64_t>(t->get_hp()));
+      mix(static_cast<std::uint64_t>(t->get_pos().x));
+      mix(static_cast<std::uint64_t>(t->get_pos().y));
+      mix(static_cast<std::uint64_t>(t->get_direction()));
+    }
+    for (std::size_t i = 0; i < g::bullets.size(); ++i)
+    {
+      if (!g::bullets.is_alive(i)) continue;
+      auto data = g::bullets.get_data(i);
+      mix(static_cast<std::uint64_t>(data.pos.x));
+      mix(static_cast<std::uint64_t>(data.pos.y));
+      mix(static_cast<std::uint64_t>(data.direction));
+      mix(static_cast<std::uint64_t>(data.from_tank_id));
+      mix(static_cast<std::uint64_t>(data.info.hp));
+    }
+    return h;
+  }
+}
@@ -17,11 +17,13 @@
 #include "tank/globals.h"
 #include "tank/bullet.h"
 #include "tank/utils.h"
+#include "tank/path.h"
 #include <map>
 #include <set>
 #include <list>
 #include <functional>
 #include <variant>
+#include <memory>
 
 namespace czh::tank
 {
@@ -30,6 +32,7 @@ namespace czh::tank
       pos(pos_), hp(info_.max_hp), hascleared(false)
   {
     g::game_map.add_tank(this, pos);
+    g::tank_index.insert(this);
   }
 
   void Tank::kill()
@@ -43,7 +46,9 @@ namespace czh::tank
     int ret = g::game_map.tank_up(pos);
     if (ret == 0)
     {
+      auto from = pos;
       pos.y++;
+      g::tank_index.move(this, from);
     }
     return ret;
   }
@@ -54,7 +59,9 @@ namespace czh::tank
     int ret = g::game_map.tank_down(pos);
     if (ret == 0)
     {
+      auto from = pos;
       pos.y--;
+      g::tank_index.move(this, from);
     }
     return ret;
   }
@@ -65,7 +72,9 @@ namespace czh::tank
     int ret = g::game_map.tank_left(pos);
     if (ret == 0)
     {
+      auto from = pos;
       pos.x--;
+      g::tank_index.move(this, from);
     }
     return ret;
   }
@@ -76,16 +85,18 @@ namespace czh::tank
     int ret = g::game_map.tank_right(pos);
     if (ret == 0)
     {
+      auto from = pos;
       pos.x++;
+      g::tank_index.move(this, from);
     }
     return ret;
   }
 
   int Tank::fire()
   {
-    g::bullets.emplace_back(
-      new bullet::Bullet(info.bullet, info.id, get_pos(), get_direction()));
-    int ret = g::game_map.add_bullet(g::bullets.back(), get_pos());
+    auto id = g::bullets.add({.pos = get_pos(), .direction = get_direction(),
+                              .from_tank_id = static_cast<int>(info.id), .info = info.bullet});
+    int ret = g::game_map.add_bullet(id, get_pos());
     return ret;
   }
 
@@ -132,6 +143,7 @@ namespace czh::tank
   void Tank::clear()
   {
     g::game_map.remove_status(map::Status::TANK, get_pos());
+    g::tank_index.remove(this);
     hascleared = true;
   }
 
@@ -145,6 +157,7 @@ namespace czh::tank
     hp -= lethality_;
     if (hp < 0) hp = 0;
     if (hp > info.max_hp) hp = info.max_hp;
+    visit(this, [](auto &t) { t.on_attacked(); });
   }
 
   [[nodiscard]] const map::Pos &Tank::get_pos() const
@@ -174,88 +187,132 @@ namespace czh::tank
     hascleared = false;
     pos = newpos;
     g::game_map.add_tank(this, pos);
+    g::tank_index.insert(this);
   }
 
-  AutoTankEvent get_pos_direction(const map::Pos &from, const map::Pos &to)
+  void TankIndex::insert(Tank *tank)
   {
-    int x = (int) from.x - (int) to.x;
-    int y = (int) from.y - (int) to.y;
-    if (x > 0)
-    {
-      return AutoTankEvent::LEFT;
-    }
-    else if (x < 0)
-    {
-      return AutoTankEvent::RIGHT;
-    }
-    else if (y > 0)
-    {
-      return AutoTankEvent::DOWN;
-    }
-    return AutoTankEvent::UP;
+    buckets[map::chunk_key(tank->get_pos())].emplace_back(tank);
   }
 
-  [[nodiscard]] int Node::get_F(const map::Pos &dest) const
+  void TankIndex::remove(Tank *tank)
   {
-    return G + (int) map::get_distance(dest, pos) * 10;
+    auto it = buckets.find(map::chunk_key(tank->get_pos()));
+    if (it == buckets.end()) return;
+    auto &bucket = it->second;
+    bucket.erase(std::remove(bucket.begin(), bucket.end(), tank), bucket.end());
+    if (bucket.empty())
+    {
+      buckets.erase(it);
+    }
   }
 
-  int &Node::get_G()
+  void TankIndex::move(Tank *tank, const map::Pos &from)
   {
-    return G;
+    auto from_key = map::chunk_key(from);
+    auto to_key = map::chunk_key(tank->get_pos());
+    if (from_key == to_key) return;
+    if (auto it = buckets.find(from_key); it != buckets.end())
+    {
+      auto &bucket = it->second;
+      bucket.erase(std::remove(bucket.begin(), bucket.end(), tank), bucket.end());
+      if (bucket.empty())
+      {
+        buckets.erase(it);
+      }
+    }
+    buckets[to_key].emplace_back(tank);
   }
 
-  map::Pos &Node::get_last()
+  std::vector<Tank *> TankIndex::query(const map::Zone &zone) const
   {
-    return last;
+    std::vector<Tank *> ret;
+    if (zone.x_min >= zone.x_max || zone.y_min >= zone.y_max) return ret;
+    for (int cx = zone.x_min >> map::chunk_shift; cx <= (zone.x_max - 1) >> map::chunk_shift; ++cx)
+    {
+      for (int cy = zone.y_min >> map::chunk_shift; cy <= (zone.y_max - 1) >> map::chunk_shift; ++cy)
+      {
+        auto it = buckets.find(map::chunk_key(cx, cy));
+        if (it == buckets.end()) continue;
+        for (auto &t: it->second)
+        {
+          if (zone.contains(t->get_pos()))
+          {
+            ret.emplace_back(t);
+          }
+        }
+      }
+    }
+    return ret;
   }
 
-  [[nodiscard]] const map::Pos &Node::get_pos() const
+  std::vector<Tank *> TankIndex::query(const map::Pos &pos, int radius) const
   {
-    return pos;
+    auto ret = query(map::Zone{pos.x - radius, pos.x + radius + 1, pos.y - radius, pos.y + radius + 1});
+    ret.erase(std::remove_if(ret.begin(), ret.end(),
+                             [&pos, radius](Tank *t)
+                             {
+                               return map::get_distance(t->get_pos(), pos) > static_cast<std::size_t>(radius);
+                             }), ret.end());
+    return ret;
   }
 
-  [[nodiscard]] bool Node::is_root() const
+  Tank *TankIndex::nearest(const map::Pos &pos, int radius) const
   {
-    return root;
+    Tank *ret = nullptr;
+    std::size_t ret_distance = 0;
+    // Search rings of chunks outwards, a tank found in ring r is at most (r + 1) chunks away,
+    // so one more ring is needed before the result is final.
+    int max_ring = (radius >> map::chunk_shift) + 1;
+    int cx = pos.x >> map::chunk_shift;
+    int cy = pos.y >> map::chunk_shift;
+    for (int r = 0; r <= max_ring; ++r)
+    {
+      for (int i = cx - r; i <= cx + r; ++i)
+      {
+        for (int j = cy - r; j <= cy + r; ++j)
+        {
+          if (std::abs(i - cx) != r && std::abs(j - cy) != r) continue;
+          auto it = buckets.find(map::chunk_key(i, j));
+          if (it == buckets.end()) continue;
+          for (auto &t: it->second)
+          {
+            if (!t->is_alive() || t->get_pos() == pos) continue;
+            auto d = map::get_distance(t->get_pos(), pos);
+            if (d > static_cast<std::size_t>(radius)) continue;
+            if (ret == nullptr || d < ret_distance)
+            {
+              ret = t;
+              ret_distance = d;
+            }
+          }
+        }
+      }
+      if (ret != nullptr && ret_distance <= static_cast<std::size_t>(r) * map::chunk_size)
+      {
+        break;
+      }
+    }
+    return ret;
   }
 
-  std::vector<Node> Node::get_neighbors() const
+  AutoTankEvent get_pos_direction(const map::Pos &from, const map::Pos &to)
   {
-    if (G + 10 > 100) return {};
-    std::vector<Node> ret;
-
-    map::Pos pos_up(pos.x, pos.y + 1);
-    map::Pos pos_down(pos.x, pos.y - 1);
-    map::Pos pos_left(pos.x - 1, pos.y);
-    map::Pos pos_right(pos.x + 1, pos.y);
-    if (check(pos_up))
-    {
-      ret.emplace_back(Node(pos_up, G + 10, pos));
-    }
-    if (check(pos_down))
+    int x = (int) from.x - (int) to.x;
+    int y = (int) from.y - (int) to.y;
+    if (x > 0)
     {
-      ret.emplace_back(Node(pos_down, G + 10, pos));
+      return AutoTankEvent::LEFT;
     }
-    if (check(pos_left))
+    else if (x < 0)
     {
-      ret.emplace_back(Node(pos_left, G + 10, pos));
+      return AutoTankEvent::RIGHT;
     }
-    if (check(pos_right))
+    else if (y > 0)
     {
-      ret.emplace_back(Node(pos_right, G + 10, pos));
+      return AutoTankEvent::DOWN;
     }
-    return ret;
-  }
-
-  bool Node::check(map::Pos &pos) const
-  {
-    return !g::game_map.has(map::Status::WALL, pos) && !g::game_map.has(map::Status::TANK, pos);
-  }
-
-  bool operator<(const Node &n1, const Node &n2)
-  {
-    return n1.get_pos() < n2.get_pos();
+    return AutoTankEvent::UP;
   }
 
   bool is_in_firing_line(int range, const map::Pos &pos, const map::Pos &target_pos)
@@ -266,36 +323,43 @@ namespace czh::tank
     {
       int a = y > 0 ? pos.y : target_pos.y;
       int b = y < 0 ? pos.y : target_pos.y;
-      for (int i = a + 1; i < b; ++i)
-      {
-        map::Pos tmp = {pos.x, i};
-        if (g::game_map.has(map::Status::WALL, tmp)
-            || g::game_map.has(map::Status::TANK, tmp))
-        {
-          return false;
-        }
-      }
+      return g::game_map.first_blocked_in_col(pos.x, a + 1, b) == b;
     }
     else if (y == 0 && std::abs(x) > 0 && std::abs(x) < range)
     {
       int a = x > 0 ? pos.x : target_pos.x;
       int b = x < 0 ? pos.x : target_pos.x;
-      for (int i = a + 1; i < b; ++i)
-      {
-        map::Pos tmp = {i, pos.y};
-        if (g::game_map.has(map::Status::WALL, tmp)
-            || g::game_map.has(map::Status::TANK, tmp))
-        {
-          return false;
-        }
-      }
+      return g::game_map.first_blocked_in_row(pos.y, a + 1, b) == b;
     }
-    else
+    return false;
+  }
+  
+  std::vector<map::Pos> get_fire_line(int range, const map::Pos &target_pos)
+  {
+    std::vector<map::Pos> ret;
+    for (auto &[dx, dy]: {std::pair{-1, 0}, std::pair{0, -1}, std::pair{0, 1}, std::pair{1, 0}})
     {
-      return false;
+      for (int i = 1; i < range; ++i)
+      {
+        map::Pos p(target_pos.x + dx * i, target_pos.y + dy * i);
+        ret.emplace_back(p);
+        if (g::game_map.has(map::Status::WALL, p) || g::game_map.has(map::Status::TANK, p)) break;
+      }
     }
-    return true;
+    std::sort(ret.begin(), ret.end());
+    return ret;
   }
+  
+  std::uint64_t get_fire_line_version(int range, const map::Pos &target_pos)
+  {
+    return std::max(
+        g::game_map.get_version({target_pos.x - range + 1, target_pos.x + range, target_pos.y, target_pos.y + 1}),
+        g::game_map.get_version({target_pos.x, target_pos.x + 1, target_pos.y - range + 1, target_pos.y + range}));
+  }
+
+  AutoTank::AutoTank(info::TankInfo info_, map::Pos pos_)
+    : Tank(std::move(info_), pos_), waypos(0), target_id(0), targeted(false), fire_line_range(0),
+      fire_line_version(0), gap_count(0), rng(static_cast<std::uint_fast32_t>(g::seed * 1000003 + info.id)) {}
 
   void AutoTank::target(std::size_t target_id_, const map::Pos &target_pos_)
   {
@@ -305,89 +369,63 @@ namespace czh::tank
     }
     target_id = target_id_;
     target_pos = target_pos_;
-    std::multimap<int, Node> open_list;
-    std::map<map::Pos, Node> close_list;
-    // fire_line
-    std::set<map::Pos> fire_line;
-    for (int i = 0; i <= target_pos.x; ++i)
-    {
-      map::Pos tmp(i, target_pos.y);
-      if (is_in_firing_line(info.bullet.range, tmp, target_pos))
+    targeted = true;
+    if (auto field = g::flow_fields.get(target_id, info.bullet.range);
+      field != nullptr && field->get_target_pos() == target_pos)
+    {
+      // A search queued for an earlier target would overwrite this way when it finishes.
+      g::path_jobs.cancel(info.id);
+      if (auto found = field->find(pos, destination_pos); found.has_value())
       {
-        fire_line.insert(tmp);
+        way = std::move(*found);
+        waypos = 0;
       }
+      return;
     }
-    for (int i = 0; i <= target_pos.y; ++i)
+    
+    auto version = std::max(get_fire_line_version(info.bullet.range, target_pos),
+                            g::game_map.get_version(path::get_window(pos)));
+    if (auto cached = g::path_cache.find({pos, target_pos, info.bullet.range}, version); cached.has_value())
     {
-      map::Pos tmp(target_pos.x, i);
-      if (is_in_firing_line(info.bullet.range, tmp, target_pos))
-      {
-        fire_line.insert(tmp);
-      }
+      g::path_jobs.cancel(info.id);
+      take_way(cached->dest, std::move(cached->way));
+      return;
     }
+    // Searched in the next ticks, and the tank keeps its way until then.
+    g::path_jobs.request(info.id, target_pos);
+  }
 
-    if (fire_line.empty()) return;
-    destination_pos = *std::min_element(fire_line.begin(), fire_line.end(),
-                                        [this](auto &&a, auto &&b)
-                                        {
-                                          return map::get_distance(a, pos) < map::get_distance(b, pos);
-                                        });
+  bool AutoTank::has_target() const
+  {
+    return targeted;
+  }
 
+  std::size_t AutoTank::get_target_id() const
+  {
+    return target_id;
+  }
 
-    Node beg(get_pos(), 0, {0, 0}, true);
-    open_list.insert({beg.get_F(destination_pos), beg});
-    int i = 0;
-    while (!open_list.empty())
+  const std::vector<map::Pos> &AutoTank::get_fire_line(const map::Pos &target_pos_, std::uint64_t version)
+  {
+    if (fire_line_range != info.bullet.range || fire_line_pos != target_pos_
+        || fire_line_version != version)
     {
-      auto it = open_list.begin();
-      auto curr = close_list.insert({it->second.get_pos(), it->second});
-      open_list.erase(it);
-      auto neighbors = curr.first->second.get_neighbors();
-      for (auto &node: neighbors)
-      {
-        auto cit = close_list.find(node.get_pos());
-        if (cit != close_list.end()) continue;
-        auto oit = std::find_if(open_list.begin(), open_list.end(),
-                                [&node](auto &&p)
-                                {
-                                  return p.second.get_pos() == node.get_pos();
-                                });
-        if (oit == open_list.end())
-        {
-          open_list.insert({node.get_F(destination_pos), node});
-        }
-        else
-        {
-          if (oit->second.get_G() > node.get_G() + 10) //less G
-          {
-            oit->second.get_G() = node.get_G() + 10;
-            oit->second.get_last() = node.get_pos();
-            int F = oit->second.get_F(destination_pos);
-            auto n = open_list.extract(oit);
-            n.key() = F;
-            open_list.insert(std::move(n));
-          }
-        }
-      }
-      auto itt = std::find_if(open_list.begin(), open_list.end(),
-                              [&fire_line](auto &&p) -> bool
-                              {
-                                return fire_line.find(p.second.get_pos()) != fire_line.end();
-                              });
-      if (itt != open_list.end()) //found
-      {
-        way.clear();
-        waypos = 0;
-        auto &np = itt->second;
-        while (!np.is_root() && np.get_pos() != np.get_last())
-        {
-          way.insert(way.begin(), get_pos_direction(close_list[np.get_last()].get_pos(), np.get_pos()));
-          np = close_list[np.get_last()];
-        }
-        return;
-      }
+      fire_line = tank::get_fire_line(info.bullet.range, target_pos_);
+      fire_line_pos = target_pos_;
+      fire_line_range = info.bullet.range;
+      fire_line_version = version;
+    }
+    return fire_line;
+  }
+
+  void AutoTank::take_way(const map::Pos &dest, std::optional<std::vector<AutoTankEvent>> found)
+  {
+    destination_pos = dest;
+    if (found.has_value())
+    {
+      way = std::move(*found);
+      waypos = 0;
     }
-    return;
   }
 
   void AutoTank::generate_random_way()
@@ -406,7 +444,7 @@ namespace czh::tank
       map::Pos pos_down(p.x, p.y - 1);
       map::Pos pos_left(p.x - 1, p.y);
       map::Pos pos_right(p.x + 1, p.y);
-      switch (utils::randnum<int>(0, 4))
+      switch (std::uniform_int_distribution<int>(0, 3)(rng))
       {
         case 0:
           if (check(pos_up))
@@ -440,40 +478,33 @@ namespace czh::tank
     }
   }
 
-  void AutoTank::attacked(int lethality_)
+  void AutoTank::on_attacked()
   {
-    Tank::attacked(lethality_);
     generate_random_way();
   }
 
-  void AutoTank::react()
+  AutoTankIntent AutoTank::plan()
   {
-    if (++gap_count < info.gap) return;
+    if (++gap_count < info.gap) return {};
     gap_count = 0;
 
     // retarget
     if (waypos == way.size())
     {
-      for (int i = get_pos().x - 15; i < get_pos().x + 15; ++i)
+      // For every column of the 30x30 window, from left to right, target the lowest alive tank.
+      auto candidates = g::tank_index.query(map::Zone{get_pos().x - 15, get_pos().x + 15,
+                                                      get_pos().y - 15, get_pos().y + 15});
+      std::sort(candidates.begin(), candidates.end(),
+                [](auto &&a, auto &&b) { return a->get_pos() < b->get_pos(); });
+      int last_x = 0;
+      bool targeted = false;
+      for (auto &t: candidates)
       {
-        for (int j = get_pos().y - 15; j < get_pos().y + 15; ++j)
-        {
-          if (i == get_pos().x && j == get_pos().y)
-          {
-            continue;
-          }
-
-          if (g::game_map.at(i, j).has(map::Status::TANK))
-          {
-            auto t = g::game_map.at(i, j).get_tank();
-            utils::tank_assert(t != nullptr);
-            if (t->is_alive())
-            {
-              target(t->get_id(), t->get_pos());
-              break;
-            }
-          }
-        }
+        if (t->get_pos() == get_pos() || !t->is_alive()) continue;
+        if (targeted && t->get_pos().x == last_x) continue;
+        target(t->get_id(), t->get_pos());
+        last_x = t->get_pos().x;
+        targeted = true;
       }
     }
 
@@ -485,25 +516,26 @@ namespace czh::tank
       waypos = 0;
       way.clear();
       // correct direction
+      AutoTankIntent ret{.event = AutoTankEvent::FIRE, .direction = direction};
       int x = (int) get_pos().x - (int) tp->get_pos().x;
       int y = (int) get_pos().y - (int) tp->get_pos().y;
       if (x > 0)
       {
-        get_direction() = map::Direction::LEFT;
+        ret.direction = map::Direction::LEFT;
       }
       else if (x < 0)
       {
-        get_direction() = map::Direction::RIGHT;
+        ret.direction = map::Direction::RIGHT;
       }
       else if (y < 0)
       {
-        get_direction() = map::Direction::UP;
+        ret.direction = map::Direction::UP;
       }
       else if (y > 0)
       {
-        get_direction() = map::Direction::DOWN;
+        ret.direction = map::Direction::DOWN;
       }
-      fire();
+      return ret;
     }
     else
     {
@@ -511,42 +543,183 @@ namespace czh::tank
       {
         generate_random_way();
       }
-      if (waypos >= way.size()) return;
-      auto w = way[waypos];
-      ++waypos;
-      switch (w)
-      {
-        case tank::AutoTankEvent::UP:
-          up();
-          break;
-        case tank::AutoTankEvent::DOWN:
-          down();
-          break;
-        case tank::AutoTankEvent::LEFT:
-          left();
-          break;
-        case tank::AutoTankEvent::RIGHT:
-          right();
-          break;
-        default:
-          break;
-      }
+      if (waypos >= way.size()) return {};
+      return {.event = way[waypos++]};
     }
   }
 
+  void AutoTank::apply(const AutoTankIntent &intent)
+  {
+    switch (intent.event)
+    {
+      case tank::AutoTankEvent::UP:
+        up();
+        break;
+      case tank::AutoTankEvent::DOWN:
+        down();
+        break;
+      case tank::AutoTankEvent::LEFT:
+        left();
+        break;
+      case tank::AutoTankEvent::RIGHT:
+        right();
+        break;
+      case tank::AutoTankEvent::FIRE:
+        direction = intent.direction;
+        fire();
+        break;
+      default:
+        break;
+    }
+  }
+
+  TankRegistry::Iterator::Iterator(std::vector<Entry>::const_iterator it_, std::vector<Entry>::const_iterator end_)
+      : it(it_), end(end_)
+  {
+    skip();
+  }
+
+  Tank *TankRegistry::Iterator::operator*() const
+  {
+    return it->tank;
+  }
+
+  TankRegistry::Iterator &TankRegistry::Iterator::operator++()
+  {
+    ++it;
+    skip();
+    return *this;
+  }
+
+  bool TankRegistry::Iterator::operator!=(const Iterator &i) const
+  {
+    return it != i.it;
+  }
+
+  void TankRegistry::Iterator::skip()
+  {
+    while (it != end && it->tank == nullptr) ++it;
+  }
+
+  TankRegistry::TankRegistry() : count(0) {}
+
+  NormalTank *TankRegistry::add_normal(const info::TankInfo &info, const map::Pos &pos)
+  {
+    NormalTank *ret;
+    std::size_t place;
+    if (free_normal_tanks.empty())
+    {
+      place = normal_tanks.size();
+      ret = &normal_tanks.emplace_back(info, pos);
+    }
+    else
+    {
+      place = free_normal_tanks.back();
+      free_normal_tanks.pop_back();
+      ret = &normal_tanks[place];
+      // Constructed in place, as the constructor puts `this` on the map.
+      std::destroy_at(ret);
+      std::construct_at(ret, info, pos);
+    }
+    set(info.id, ret, place);
+    return ret;
+  }
+
+  AutoTank *TankRegistry::add_auto(const info::TankInfo &info, const map::Pos &pos)
+  {
+    AutoTank *ret;
+    std::size_t place;
+    if (free_auto_tanks.empty())
+    {
+      place = auto_tanks.size();
+      ret = &auto_tanks.emplace_back(info, pos);
+    }
+    else
+    {
+      place = free_auto_tanks.back();
+      free_auto_tanks.pop_back();
+      ret = &auto_tanks[place];
+      std::destroy_at(ret);
+      std::construct_at(ret, info, pos);
+    }
+    set(info.id, ret, place);
+    return ret;
+  }
+
+  void TankRegistry::set(std::size_t id, Tank *tank, std::size_t place)
+  {
+    if (id >= by_id.size())
+    {
+      by_id.resize(id + 1, Entry{.tank = nullptr, .place = 0});
+    }
+    utils::tank_assert(by_id[id].tank == nullptr, "Duplicate tank id.");
+    by_id[id] = {.tank = tank, .place = place};
+    ++count;
+  }
+
+  void TankRegistry::remove(std::size_t id)
+  {
+    auto tank = at(id);
+    utils::tank_assert(tank != nullptr && !tank->is_alive() && tank->has_cleared(), "Invalid tank to remove.");
+    if (tank->is_auto())
+    {
+      free_auto_tanks.emplace_back(by_id[id].place);
+    }
+    else
+    {
+      free_normal_tanks.emplace_back(by_id[id].place);
+    }
+    by_id[id].tank = nullptr;
+    --count;
+  }
+
+  void TankRegistry::clear()
+  {
+    normal_tanks.clear();
+    auto_tanks.clear();
+    free_normal_tanks.clear();
+    free_auto_tanks.clear();
+    by_id.clear();
+    count = 0;
+  }
+
+  Tank *TankRegistry::at(std::size_t id) const
+  {
+    return id < by_id.size() ? by_id[id].tank : nullptr;
+  }
+
+  std::size_t TankRegistry::size() const
+  {
+    return count;
+  }
+
+  TankRegistry::Iterator TankRegistry::begin() const
+  {
+    return {by_id.begin(), by_id.end()};
+  }
+
+  TankRegistry::Iterator TankRegistry::end() const
+  {
+    return {by_id.end(), by_id.end()};
+  }
+
   Tank *build_tank(const TankData &data)
   {
     if (data.is_auto())
     {
-      auto ret = new AutoTank(data.info, data.pos);
+      auto ret = g::tanks.add_auto(data.info, data.pos);
       ret->hp = data.hp;
       ret->direction = data.direction;
-      ret->hascleared = data.hascleared;
+      if (data.hascleared)
+      {
+        ret->clear();
+      }
 
       auto &d = std::get<AutoTankData>(data.data);
       ret->target_id = d.target_id;
       ret->target_pos = d.target_pos;
       ret->destination_pos = d.destination_pos;
+      ret->targeted = d.targeted;
 
       ret->way = d.way;
       ret->waypos = d.waypos;
@@ -556,10 +729,13 @@ namespace czh::tank
     }
     else
     {
-      auto ret = new NormalTank(data.info, data.pos);
+      auto ret = g::tanks.add_normal(data.info, data.pos);
       ret->hp = data.hp;
       ret->direction = data.direction;
-      ret->hascleared = data.hascleared;
+      if (data.hascleared)
+      {
+        ret->clear();
+      }
       //auto& d = std::get<map::NormalTankData>(data.data);
       return ret;
     }
@@ -576,12 +752,13 @@ namespace czh::tank
     ret.hascleared = t->hascleared;
     if (t->is_auto())
     {
-      auto tank = dynamic_cast<tank::AutoTank *>(t);
+      auto tank = static_cast<tank::AutoTank *>(t);
       AutoTankData data;
 
       data.target_id = tank->target_id;
       data.target_pos = tank->target_pos;
       data.destination_pos = tank->destination_pos;
+      data.targeted = tank->targeted;
 
       data.way = tank->way;
       data.waypos = tank->waypos;
@@ -591,7 +768,6 @@ namespace czh::tank
     }
     else
     {
-      // auto tank = dynamic_cast<tank::NormalTank *>(t);
       NormalTankData data;
       ret.data.emplace<NormalTankData>(data);
     }
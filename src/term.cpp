@@ -22,10 +22,8 @@ namespace czh::g
 
 namespace czh::term
 {
-  KeyBoard::KeyBoard()
-  {
-    init();
-  }
+  // The terminal is only set up by init(), so that a headless server never touches it.
+  KeyBoard::KeyBoard() = default;
   
   void KeyBoard::init()
   {
@@ -51,11 +49,15 @@ namespace czh::term
 #endif
     output("\x1b[?1049h");
     flush();
+    active = true;
   }
   
   KeyBoard::~KeyBoard()
   {
-    deinit();
+    if (active)
+    {
+      deinit();
+    }
   }
   
   void KeyBoard::deinit()
@@ -69,6 +71,7 @@ namespace czh::term
     show_cursor();
     output("\x1b[?1049l");
     flush();
+    active = false;
   }
   
   int KeyBoard::kbhit()